@@ -0,0 +1,201 @@
+#include "i2c_bus.h"
+
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+
+// Constants and Macros
+#define TAG "I2C_BUS"
+
+// A register read is two transactions: the register write and the repeated-start read
+#define CMD_LINK_SIZE I2C_LINK_RECOMMENDED_SIZE(2)
+
+#define QUEUE_LENGTH    8
+#define TASK_STACK_SIZE 4096
+#define TASK_PRIORITY   5
+
+// Per-port command link storage, reused for every transfer instead of a heap allocation
+typedef struct {
+    uint8_t           cmd_buffer[CMD_LINK_SIZE];
+    SemaphoreHandle_t lock;
+    StaticSemaphore_t lock_storage;
+} i2c_bus_t;
+
+static i2c_bus_t         s_buses[I2C_NUM_MAX];
+static i2c_bus_device_t *s_devices = NULL;
+static QueueHandle_t      s_queue = NULL;
+static TaskHandle_t       s_task = NULL;
+
+// Convert a timeout to ticks, rounding up and adding one tick for the partial current tick
+static TickType_t timeout_ticks(uint32_t timeout_ms) {
+    return (timeout_ms + portTICK_PERIOD_MS - 1) / portTICK_PERIOD_MS + 1;
+}
+
+// Serve queued requests one after another and report each to its callback
+static void bus_task(void *arg) {
+    i2c_bus_request_t *req;
+    esp_err_t          err;
+
+    while (1) {
+        xQueueReceive(s_queue, &req, portMAX_DELAY);
+
+        if (req->op == I2C_BUS_OP_WRITE) {
+            err = i2c_bus_write(req->dev, req->reg_addr, req->data, req->len);
+        } else {
+            err = i2c_bus_read(req->dev, req->reg_addr, req->data, req->len);
+        }
+
+        if (req->callback) {
+            req->callback(req, err);
+        }
+    }
+}
+
+// Create the request queue and the task serving it, shared by all ports
+static esp_err_t start_bus_task(void) {
+    if (s_queue != NULL) {
+        return ESP_OK;
+    }
+
+    s_queue = xQueueCreate(QUEUE_LENGTH, sizeof(i2c_bus_request_t *));
+    if (s_queue == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    if (xTaskCreate(bus_task, "i2c_bus", TASK_STACK_SIZE, NULL, TASK_PRIORITY, &s_task) != pdPASS) {
+        vQueueDelete(s_queue);
+        s_queue = NULL;
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+// Install the master driver on a port and prepare its command link storage
+esp_err_t i2c_bus_init(i2c_port_t port, int sda_io, int scl_io, uint32_t clk_speed) {
+    i2c_config_t i2c_config = {
+        .mode = I2C_MODE_MASTER,
+        .sda_io_num = sda_io,
+        .scl_io_num = scl_io,
+        .sda_pullup_en = GPIO_PULLUP_ENABLE,
+        .scl_pullup_en = GPIO_PULLUP_ENABLE,
+        .master.clk_speed = clk_speed};
+
+    esp_err_t err = i2c_param_config(port, &i2c_config);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    s_buses[port].lock = xSemaphoreCreateMutexStatic(&s_buses[port].lock_storage);
+    err = i2c_driver_install(port, i2c_config.mode, 0, 0, 0);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    return start_bus_task();
+}
+
+// Register a device so its counters show up in i2c_bus_log_stats()
+void i2c_bus_add_device(i2c_bus_device_t *dev) {
+    for (i2c_bus_device_t *it = s_devices; it != NULL; it = it->next) {
+        if (it == dev) {
+            return;
+        }
+    }
+    dev->next = s_devices;
+    s_devices = dev;
+}
+
+// Run a command link built in the port's static buffer and update the device counters
+static esp_err_t execute(i2c_bus_device_t *dev, i2c_cmd_handle_t cmd, size_t len) {
+    esp_err_t err = i2c_master_cmd_begin(dev->port, cmd, timeout_ticks(dev->timeout_ms));
+    i2c_cmd_link_delete_static(cmd);
+
+    dev->transactions++;
+    if (err == ESP_OK) {
+        dev->bytes += len;
+    } else {
+        dev->errors++;
+    }
+    return err;
+}
+
+// Write len bytes starting at reg_addr
+esp_err_t i2c_bus_write(i2c_bus_device_t *dev, uint8_t reg_addr, const uint8_t *data, size_t len) {
+    i2c_bus_t *bus = &s_buses[dev->port];
+    esp_err_t  err;
+
+    xSemaphoreTake(bus->lock, portMAX_DELAY);
+    i2c_cmd_handle_t cmd = i2c_cmd_link_create_static(bus->cmd_buffer, sizeof(bus->cmd_buffer));
+    if (cmd == NULL) {
+        xSemaphoreGive(bus->lock);
+        return ESP_ERR_NO_MEM;
+    }
+
+    i2c_master_start(cmd);
+    i2c_master_write_byte(cmd, (dev->addr << 1) | I2C_MASTER_WRITE, true);
+    i2c_master_write_byte(cmd, reg_addr, true);
+    i2c_master_write(cmd, data, len, true);
+    i2c_master_stop(cmd);
+
+    err = execute(dev, cmd, len);
+    xSemaphoreGive(bus->lock);
+    return err;
+}
+
+// Read len bytes starting at reg_addr
+esp_err_t i2c_bus_read(i2c_bus_device_t *dev, uint8_t reg_addr, uint8_t *data, size_t len) {
+    i2c_bus_t *bus = &s_buses[dev->port];
+    esp_err_t  err;
+
+    if (len == 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    xSemaphoreTake(bus->lock, portMAX_DELAY);
+    i2c_cmd_handle_t cmd = i2c_cmd_link_create_static(bus->cmd_buffer, sizeof(bus->cmd_buffer));
+    if (cmd == NULL) {
+        xSemaphoreGive(bus->lock);
+        return ESP_ERR_NO_MEM;
+    }
+
+    i2c_master_start(cmd);
+    i2c_master_write_byte(cmd, (dev->addr << 1) | I2C_MASTER_WRITE, true);
+    i2c_master_write_byte(cmd, reg_addr, true);
+    i2c_master_start(cmd);
+    i2c_master_write_byte(cmd, (dev->addr << 1) | I2C_MASTER_READ, true);
+    if (len > 1) {
+        i2c_master_read(cmd, data, len - 1, I2C_MASTER_ACK);
+    }
+    i2c_master_read_byte(cmd, data + len - 1, I2C_MASTER_NACK);
+    i2c_master_stop(cmd);
+
+    err = execute(dev, cmd, len);
+    xSemaphoreGive(bus->lock);
+    return err;
+}
+
+// Queue a transfer for the bus task; the callback reports its result
+esp_err_t i2c_bus_submit(i2c_bus_request_t *req) {
+    if (s_queue == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (req->len == 0 && req->op == I2C_BUS_OP_READ) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    // Callbacks chaining the next step run in the bus task, which must never block on its own queue
+    TickType_t wait = (xTaskGetCurrentTaskHandle() == s_task) ? 0 : portMAX_DELAY;
+    if (xQueueSend(s_queue, &req, wait) != pdTRUE) {
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+// Log the transaction counters of every registered device
+void i2c_bus_log_stats(void) {
+    for (i2c_bus_device_t *dev = s_devices; dev != NULL; dev = dev->next) {
+        ESP_LOGI(TAG, "%s@0x%02x: %lu transactions, %lu errors, %lu bytes",
+                 dev->name, dev->addr, dev->transactions, dev->errors, dev->bytes);
+    }
+}
@@ -0,0 +1,57 @@
+#ifndef I2C_BUS_H
+#define I2C_BUS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "driver/i2c.h"
+#include "esp_err.h"
+
+#define I2C_BUS_DEFAULT_TIMEOUT_MS 50
+
+// One device on a shared bus, with its transaction counters
+typedef struct i2c_bus_device {
+    const char *name;
+    i2c_port_t  port;
+    uint8_t     addr;
+    uint32_t    timeout_ms;
+
+    uint32_t transactions;
+    uint32_t errors;
+    uint32_t bytes;
+
+    struct i2c_bus_device *next;
+} i2c_bus_device_t;
+
+#define I2C_BUS_DEVICE(port_, addr_, name_) \
+    {.name = (name_), .port = (port_), .addr = (addr_), .timeout_ms = I2C_BUS_DEFAULT_TIMEOUT_MS}
+
+typedef enum {
+    I2C_BUS_OP_WRITE,
+    I2C_BUS_OP_READ,
+} i2c_bus_op_t;
+
+typedef struct i2c_bus_request i2c_bus_request_t;
+
+// Completion callback, runs in the bus task; keep it short and do not block
+typedef void (*i2c_bus_callback_t)(i2c_bus_request_t *req, esp_err_t err);
+
+// Asynchronous register transfer; must stay valid until its callback has run
+struct i2c_bus_request {
+    i2c_bus_device_t  *dev;
+    i2c_bus_op_t       op;
+    uint8_t            reg_addr;
+    uint8_t           *data;
+    size_t             len;
+    i2c_bus_callback_t callback;
+    void              *arg;
+};
+
+esp_err_t i2c_bus_init(i2c_port_t port, int sda_io, int scl_io, uint32_t clk_speed);
+void      i2c_bus_add_device(i2c_bus_device_t *dev);
+esp_err_t i2c_bus_write(i2c_bus_device_t *dev, uint8_t reg_addr, const uint8_t *data, size_t len);
+esp_err_t i2c_bus_read(i2c_bus_device_t *dev, uint8_t reg_addr, uint8_t *data, size_t len);
+esp_err_t i2c_bus_submit(i2c_bus_request_t *req);
+void      i2c_bus_log_stats(void);
+
+#endif
@@ -0,0 +1,139 @@
+#include "alerts.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "bme.h"
+#include "climate.h"
+#include "esp_attr.h"
+#include "esp_log.h"
+
+// Constants and Macros
+#define TAG "ALERTS"
+
+#define HYSTERESIS_DIVIDER 20 // Leaving an alert needs the value 1/20 of the range back inside
+#define ENTER_DWELL        2  // Consecutive readings out of range before an alert is raised
+#define EXIT_DWELL         2  // Consecutive readings back in range before it is cleared
+
+// One limited metric: its alert bit, the sample fields it needs and where its range lives
+typedef struct {
+    uint32_t alert;
+    uint32_t field;
+    size_t   range;    // Offset of the Range in Limits
+    bool     optional; // Checked only if the server sent a range
+    double (*value)(const Sample *sample, int index);
+} AlertMetric;
+
+static double moisture_value(const Sample *sample, int i) { return sample->moisture[i]; }
+static double temperature_value(const Sample *sample, int i) { return (double)sample->temperature[i] / BME_TEMPERATURE_SCALE; }
+static double humidity_value(const Sample *sample, int i) { return (double)sample->humidity[i] / BME_HUMIDITY_SCALE; }
+static double pressure_value(const Sample *sample, int i) { return (double)sample->pressure[i] / BME_PRESSURE_SCALE; }
+static double white_value(const Sample *sample, int i) { return sample->white; }
+static double visible_value(const Sample *sample, int i) { return sample->visible; }
+static double vpd_value(const Sample *sample, int i) { return (double)sample->vpd[i] / CLIMATE_VPD_SCALE; }
+static double dew_point_value(const Sample *sample, int i) { return (double)sample->dew_point[i] / CLIMATE_DEW_POINT_SCALE; }
+static double abs_humidity_value(const Sample *sample, int i) { return (double)sample->abs_humidity[i] / CLIMATE_ABS_HUMIDITY_SCALE; }
+
+static const AlertMetric s_metrics[] = {
+    {ALERT_MOISTURE, SAMPLE_MOISTURE, offsetof(Limits, moisture), false, moisture_value},
+    {ALERT_TEMPERATURE, SAMPLE_CLIMATE, offsetof(Limits, temperature), false, temperature_value},
+    {ALERT_HUMIDITY, SAMPLE_CLIMATE, offsetof(Limits, humidity), false, humidity_value},
+    {ALERT_PRESSURE, SAMPLE_CLIMATE, offsetof(Limits, pressure), false, pressure_value},
+    {ALERT_WHITE, SAMPLE_LIGHT, offsetof(Limits, white), false, white_value},
+    {ALERT_VISIBLE, SAMPLE_LIGHT, offsetof(Limits, visible), false, visible_value},
+    {ALERT_VPD, SAMPLE_CLIMATE, offsetof(Limits, vpd), true, vpd_value},
+    {ALERT_DEW_POINT, SAMPLE_CLIMATE, offsetof(Limits, dew_point), true, dew_point_value},
+    {ALERT_ABS_HUMIDITY, SAMPLE_CLIMATE, offsetof(Limits, abs_humidity), true, abs_humidity_value},
+};
+
+#define METRIC_COUNT (sizeof(s_metrics) / sizeof(s_metrics[0]))
+
+RTC_DATA_ATTR static uint32_t s_active = 0;         // Raised alerts
+RTC_DATA_ATTR static uint8_t  s_dwell[METRIC_COUNT]; // Readings in a row pointing to the other state
+
+// Check whether a reading argues for the other state of its alert
+// Inside the range clears an alert only once it is past the hysteresis margin.
+static bool wants_change(const Range *range, double value, bool active) {
+    if (!active) {
+        return value < range->min || value > range->max;
+    }
+    double margin = (range->max - range->min) / HYSTERESIS_DIVIDER;
+    return value >= range->min + margin && value <= range->max - margin;
+}
+
+// Instances of a field group present in the sample, light has a single sensor
+static uint32_t instances(const Sample *sample, uint32_t field) {
+    switch (field) {
+        case SAMPLE_MOISTURE:
+            return sample->moisture_mask;
+        case SAMPLE_CLIMATE:
+            return sample->climate_mask;
+        default:
+            return 1;
+    }
+}
+
+// One alert covers all instances of a metric: any instance out of range raises it,
+// and it only clears once every instance is back past the margin
+static bool metric_wants_change(const AlertMetric *metric, const Range *range, const Sample *sample, bool active) {
+    uint32_t mask = instances(sample, metric->field);
+    bool     any = false;
+
+    for (int i = 0; mask >> i; i++) {
+        if (!(mask & (1 << i))) {
+            continue;
+        }
+        bool change = wants_change(range, metric->value(sample, i), active);
+        if (!active && change) {
+            return true;
+        }
+        if (active && !change) {
+            return false;
+        }
+        any = true;
+    }
+    return active && any;
+}
+
+// Run the measured metrics through the alert state machines
+// Returns the raised alerts; transitions are recorded in the sample for the upload.
+uint32_t alerts_update(const Limits *limits, Sample *sample) {
+    uint32_t previous = s_active;
+
+    for (size_t m = 0; m < METRIC_COUNT; m++) {
+        const AlertMetric *metric = &s_metrics[m];
+        const Range       *range = (const Range *)((const uint8_t *)limits + metric->range);
+
+        if (!(sample->valid & metric->field)) {
+            continue;
+        }
+        if (metric->optional && !(range->min < range->max)) {
+            s_active &= ~metric->alert;
+            s_dwell[m] = 0;
+            continue;
+        }
+
+        bool active = s_active & metric->alert;
+        if (!metric_wants_change(metric, range, sample, active)) {
+            s_dwell[m] = 0;
+            continue;
+        }
+        if (++s_dwell[m] >= (active ? EXIT_DWELL : ENTER_DWELL)) {
+            s_active ^= metric->alert;
+            s_dwell[m] = 0;
+        }
+    }
+
+    sample->alerts = s_active;
+    sample->alert_changes = s_active ^ previous;
+    if (sample->alert_changes) {
+        sample->valid |= SAMPLE_ALERTS;
+        ESP_LOGI(TAG, "Alerts 0x%03lx, changed 0x%03lx", s_active, sample->alert_changes);
+    }
+    return s_active;
+}
+
+// Alerts raised as of the last update, kept across deep sleep
+uint32_t alerts_active(void) {
+    return s_active;
+}
@@ -0,0 +1,131 @@
+#include "analog.h"
+
+#include <stdbool.h>
+
+#include "esp_adc/adc_cali.h"
+#include "esp_adc/adc_cali_scheme.h"
+#include "esp_log.h"
+
+// Constants and Macros
+#define TAG "ANALOG"
+
+#define ADC_ATTEN        ADC_ATTEN_DB_11 // 0 - ~2.5 V, enough for the probe and the divided cell
+#define NOMINAL_RANGE_MV 2500            // Uncalibrated full scale at ADC_ATTEN
+#define MAX_SAMPLES      32
+
+static adc_oneshot_unit_handle_t s_unit = NULL;
+static adc_cali_handle_t         s_cali[SOC_ADC_MAX_CHANNEL_NUM];
+
+// Create the calibration scheme from the eFuse values of this chip
+static adc_cali_handle_t create_cali(adc_channel_t channel) {
+    adc_cali_handle_t handle = NULL;
+    esp_err_t         err = ESP_ERR_NOT_SUPPORTED;
+
+#if ADC_CALI_SCHEME_CURVE_FITTING_SUPPORTED
+    adc_cali_curve_fitting_config_t config = {
+        .unit_id = ADC_UNIT_1,
+        .chan = channel,
+        .atten = ADC_ATTEN,
+        .bitwidth = ADC_BITWIDTH_DEFAULT,
+    };
+    err = adc_cali_create_scheme_curve_fitting(&config, &handle);
+#elif ADC_CALI_SCHEME_LINE_FITTING_SUPPORTED
+    adc_cali_line_fitting_config_t config = {
+        .unit_id = ADC_UNIT_1,
+        .atten = ADC_ATTEN,
+        .bitwidth = ADC_BITWIDTH_DEFAULT,
+    };
+    err = adc_cali_create_scheme_line_fitting(&config, &handle);
+#endif
+
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "No calibration for channel %d: %s", channel, esp_err_to_name(err));
+        return NULL;
+    }
+    return handle;
+}
+
+// Register a channel on ADC1, creating the unit on first use
+esp_err_t analog_add_channel(adc_channel_t channel) {
+    if (s_unit == NULL) {
+        adc_oneshot_unit_init_cfg_t unit_config = {
+            .unit_id = ADC_UNIT_1,
+        };
+        esp_err_t err = adc_oneshot_new_unit(&unit_config, &s_unit);
+        if (err != ESP_OK) {
+            return err;
+        }
+    }
+
+    adc_oneshot_chan_cfg_t config = {
+        .atten = ADC_ATTEN,
+        .bitwidth = ADC_BITWIDTH_DEFAULT,
+    };
+    esp_err_t err = adc_oneshot_config_channel(s_unit, channel, &config);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    if (s_cali[channel] == NULL) {
+        s_cali[channel] = create_cali(channel);
+    }
+    return ESP_OK;
+}
+
+// Insert the newest sample into a sorted burst, the burst is short
+static void insert_sorted(int *raw, int count) {
+    for (int j = count - 1; j > 0 && raw[j - 1] > raw[j]; j--) {
+        int tmp = raw[j];
+        raw[j] = raw[j - 1];
+        raw[j - 1] = tmp;
+    }
+}
+
+// Mean of the middle half of a sorted burst, converted to millivolts
+// Sorting first drops the outliers from switching noise before averaging.
+static uint32_t trimmed_mv(adc_channel_t channel, const int *raw, int samples) {
+    int first = samples / 4;
+    int last = samples - first;
+    int sum = 0;
+    for (int i = first; i < last; i++) {
+        sum += raw[i];
+    }
+    int average = (sum + (last - first) / 2) / (last - first);
+
+    int voltage;
+    if (s_cali[channel] != NULL && adc_cali_raw_to_voltage(s_cali[channel], average, &voltage) == ESP_OK) {
+        return voltage;
+    }
+    return (uint32_t)average * NOMINAL_RANGE_MV / 4095;
+}
+
+// Take a burst of samples and return the mean of the middle half in millivolts
+esp_err_t analog_read_mv(adc_channel_t channel, int samples, uint32_t *millivolts) {
+    return analog_read_scan(&channel, 1, samples, millivolts);
+}
+
+// Take a burst on several channels at once, one millivolt result per channel
+// The channels are sampled round-robin so slow drift and supply ripple hit all of them alike,
+// and a shared excitation only has to stay on for one burst.
+esp_err_t analog_read_scan(const adc_channel_t *channels, int count, int samples, uint32_t *millivolts) {
+    int raw[SOC_ADC_MAX_CHANNEL_NUM][MAX_SAMPLES];
+
+    if (s_unit == NULL || count <= 0 || count > SOC_ADC_MAX_CHANNEL_NUM || samples <= 0 || samples > MAX_SAMPLES) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    for (int i = 0; i < samples; i++) {
+        for (int c = 0; c < count; c++) {
+            esp_err_t err = adc_oneshot_read(s_unit, channels[c], &raw[c][i]);
+            if (err != ESP_OK) {
+                return err;
+            }
+            insert_sorted(raw[c], i + 1);
+        }
+    }
+
+    for (int c = 0; c < count; c++) {
+        millivolts[c] = trimmed_mv(channels[c], raw[c], samples);
+    }
+    return ESP_OK;
+}
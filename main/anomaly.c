@@ -0,0 +1,104 @@
+#include "anomaly.h"
+
+#include <math.h>
+
+#include "bme.h"
+#include "esp_attr.h"
+#include "esp_log.h"
+
+// Constants and Macros
+#define TAG "ANOMALY"
+
+#define ALPHA         0.2f // Weight of the newest sample, about a five-wake memory
+#define THRESHOLD     4.0f // Deviations from the mean that count as a jump
+#define WARMUP        5    // Samples before a metric is judged
+#define METRIC_COUNT  3
+#define INSTANCE_MAX  (MOISTURE_PROBES > CLIMATE_SENSORS ? MOISTURE_PROBES : CLIMATE_SENSORS)
+
+// Tracked metrics; light is left out, sunrise and sunset are jumps by nature
+typedef enum {
+    METRIC_MOISTURE = 0,
+    METRIC_TEMPERATURE,
+    METRIC_HUMIDITY,
+} Metric;
+
+// Running statistics of one metric
+typedef struct {
+    float    mean;
+    float    variance;
+    uint16_t count;
+} Ewma;
+
+static const char *const s_names[METRIC_COUNT] = {"moisture", "temperature", "humidity"};
+static const uint32_t    s_fields[METRIC_COUNT] = {SAMPLE_MOISTURE, SAMPLE_CLIMATE, SAMPLE_CLIMATE};
+
+// Smallest deviation considered, so a metric that sat still does not flag its own noise
+static const float s_min_deviation[METRIC_COUNT] = {2.0f, 0.5f, 3.0f};
+
+// Each probe and each BME280 keeps its own trend
+RTC_DATA_ATTR static Ewma s_stats[METRIC_COUNT][INSTANCE_MAX];
+
+// Metric values in their reported units
+static float metric_value(const Sample *sample, Metric metric, int index) {
+    switch (metric) {
+        case METRIC_MOISTURE:
+            return sample->moisture[index];
+        case METRIC_TEMPERATURE:
+            return (float)sample->temperature[index] / BME_TEMPERATURE_SCALE;
+        default:
+            return (float)sample->humidity[index] / BME_HUMIDITY_SCALE;
+    }
+}
+
+// Instances of a metric present in the sample
+static uint32_t metric_mask(const Sample *sample, Metric metric) {
+    return metric == METRIC_MOISTURE ? sample->moisture_mask : sample->climate_mask;
+}
+
+// Score the sample against the running statistics, then fold it in
+// A jump is folded in as well, so a lasting change like watering only flags once.
+bool anomaly_update(Sample *sample) {
+    bool urgent = false;
+
+    for (int m = 0; m < METRIC_COUNT; m++) {
+        if (!(sample->valid & s_fields[m])) {
+            continue;
+        }
+
+        uint32_t mask = metric_mask(sample, m);
+        for (int i = 0; i < INSTANCE_MAX; i++) {
+            Ewma *stats = &s_stats[m][i];
+            if (!(mask & (1 << i))) {
+                continue;
+            }
+
+            float value = metric_value(sample, m, i);
+            float diff = value - stats->mean;
+
+            if (stats->count >= WARMUP) {
+                float deviation = fmaxf(sqrtf(stats->variance), s_min_deviation[m]);
+                if (fabsf(diff) > THRESHOLD * deviation) {
+                    ESP_LOGW(TAG, "%s %d jumped to %.2f, mean %.2f, deviation %.2f", s_names[m], i, value, stats->mean, deviation);
+                    urgent = true;
+                }
+            }
+
+            if (stats->count == 0) {
+                stats->mean = value;
+                stats->variance = 0;
+            } else {
+                float increment = ALPHA * diff;
+                stats->mean += increment;
+                stats->variance = (1 - ALPHA) * (stats->variance + diff * increment);
+            }
+            if (stats->count < UINT16_MAX) {
+                stats->count++;
+            }
+        }
+    }
+
+    if (urgent) {
+        sample->valid |= SAMPLE_URGENT;
+    }
+    return urgent;
+}
@@ -0,0 +1,56 @@
+#include "battery.h"
+
+#include "analog.h"
+#include "esp_log.h"
+
+// Constants and Macros
+#define TAG "BATTERY"
+
+#define BATTERY_ADC_CHANNEL ADC_CHANNEL_2
+#define DIVIDER_RATIO       2 // Battery is measured through a 1:1 resistor divider
+#define SAMPLE_COUNT        8
+
+// Thresholds for a single Li-ion cell at rest
+#define LOW_MV      3600
+#define VERY_LOW_MV 3450
+#define CRITICAL_MV 3300
+
+void battery_init(void) {
+    ESP_ERROR_CHECK_WITHOUT_ABORT(analog_add_channel(BATTERY_ADC_CHANNEL));
+}
+
+// Read the battery voltage in millivolts, filtered over a few samples, 0 if the read failed
+uint32_t battery_read_mv(void) {
+    uint32_t  millivolts = 0;
+    esp_err_t err = analog_read_mv(BATTERY_ADC_CHANNEL, SAMPLE_COUNT, &millivolts);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Read failed: %s", esp_err_to_name(err));
+        return 0;
+    }
+
+    millivolts *= DIVIDER_RATIO;
+    ESP_LOGI(TAG, "Battery: %lu mV", millivolts);
+    return millivolts;
+}
+
+// Map a voltage onto the degradation tiers
+BatteryLevel battery_level(uint32_t millivolts) {
+    if (millivolts < CRITICAL_MV) return BATTERY_CRITICAL;
+    if (millivolts < VERY_LOW_MV) return BATTERY_VERY_LOW;
+    if (millivolts < LOW_MV) return BATTERY_LOW;
+    return BATTERY_OK;
+}
+
+// Multiplier applied to the sleep interval at each tier
+uint32_t battery_sleep_factor(BatteryLevel level) {
+    switch (level) {
+        case BATTERY_LOW:
+            return 2;
+        case BATTERY_VERY_LOW:
+            return 4;
+        case BATTERY_CRITICAL:
+            return 8;
+        default:
+            return 1;
+    }
+}
@@ -1,133 +1,449 @@
 #include "bme.h"
 
 #include <rom/ets_sys.h>
+#include <stddef.h>
+#include <string.h>
 
 #include "bme280.h"
-#include "driver/i2c.h"
+#include "climate.h"
+#include "esp_attr.h"
 #include "esp_err.h"
 #include "esp_log.h"
+#include "esp_rom_crc.h"
+#include "esp_sleep.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "i2c_bus.h"
+#include "power.h"
 
 // Constants and Macros
 #define TAG             "BME_WRAPPER"
-#define BME280_DEV_ADDR BME280_I2C_ADDR_PRIM
+#define TICK_PERIOD_US  (portTICK_PERIOD_MS * 1000)
 
-// BME280 configuration
-uint8_t           bme280_dev_addr = BME280_I2C_ADDR_PRIM;
-struct bme280_dev dev = {
-    .intf_ptr = &bme280_dev_addr,
-    .intf = BME280_I2C_INTF,
-    .read = BME280_I2C_bus_read,
-    .write = BME280_I2C_bus_write,
-    .delay_us = BME280_delay_usek};
+#define BME_PERIOD_SECONDS 3600 // Minimum time between two readings
+
+// Conversion completion: 1 polls the status register after the typical time, 0 sleeps the worst case
+#define BME_POLL_STATUS       1
+#define POLL_INTERVAL_US      500
+#define MEAS_TYP_OFFSET_US    1000 // Typical timings from the datasheet, section 9.1
+#define MEAS_TYP_DUR_US       2000
+#define MEAS_TYP_PH_OFFSET_US 500
 
 // Helper function to write data to BME280 using I2C
 int8_t BME280_I2C_bus_write(uint8_t reg_addr, const uint8_t *reg_data, uint32_t cnt, void *interface) {
-    int8_t           Error;
-    esp_err_t        espRc;
-    i2c_cmd_handle_t cmd = i2c_cmd_link_create();
+    esp_err_t espRc = i2c_bus_write((i2c_bus_device_t *)interface, reg_addr, reg_data, cnt);
+    return (espRc == ESP_OK) ? BME280_OK : BME280_E_COMM_FAIL;
+}
+
+// Helper function to read data from BME280 using I2C
+int8_t BME280_I2C_bus_read(uint8_t reg_addr, uint8_t *reg_data, uint32_t cnt, void *interface) {
+    esp_err_t espRc = i2c_bus_read((i2c_bus_device_t *)interface, reg_addr, reg_data, cnt);
+    return (espRc == ESP_OK) ? BME280_OK : BME280_E_COMM_FAIL;
+}
+
+// Chip ID and factory trim values, kept across deep sleep so a timer wakeup skips re-reading them
+typedef struct {
+    uint8_t                  chip_id;
+    struct bme280_calib_data calib_data;
+    uint32_t                 crc;
+} CalibCache;
+
+RTC_DATA_ATTR static CalibCache s_calib_cache[CLIMATE_SENSORS];
+
+// Shadow of ctrl_hum, ctrl_meas and config, kept across deep sleep to skip redundant writes
+typedef struct {
+    uint8_t ctrl_hum;
+    uint8_t ctrl_meas;
+    uint8_t config;
+    uint8_t valid;
+} RegShadow;
+
+RTC_DATA_ATTR static RegShadow s_shadow[CLIMATE_SENSORS];
+
+// Sensors that did not answer on the last cold boot, not probed again until the next one
+RTC_DATA_ATTR static uint8_t s_absent;
 
-    // Configure and start I2C write sequence
-    i2c_master_start(cmd);
-    i2c_master_write_byte(cmd, (BME280_DEV_ADDR << 1) | I2C_MASTER_WRITE, true);
-    i2c_master_write_byte(cmd, reg_addr, true);
-    i2c_master_write(cmd, reg_data, cnt, true);
-    i2c_master_stop(cmd);
+// Forced-mode measurement profile
+static const struct bme280_settings s_profile = {
+    .osr_h = BME280_OVERSAMPLING_2X,
+    .osr_p = BME280_OVERSAMPLING_2X,
+    .osr_t = BME280_OVERSAMPLING_2X,
+    .filter = BME280_FILTER_COEFF_OFF,
+    .standby_time = BME280_STANDBY_TIME_0_5_MS};
 
-    // Execute the write operation and handle the result
-    espRc = i2c_master_cmd_begin(I2C_NUM_0, cmd, 10 / portTICK_PERIOD_MS);
-    Error = (espRc == ESP_OK) ? BME280_OK : BME280_E_COMM_FAIL;
+// State of the asynchronous read started by BME_start_read()
+typedef struct {
+    i2c_bus_request_t  req;
+    uint8_t            buffer[BME280_LEN_P_T_H_DATA];
+    RegShadow          image;
+    int64_t            deadline;
+    esp_timer_handle_t timer;
+    SemaphoreHandle_t  done;
+    struct bme280_data data;
+    int8_t             rslt;
+    bool               pending;
+} ReadState;
 
-    i2c_cmd_link_delete(cmd);
-    return Error;
+// One BME280 on the bus
+typedef struct {
+    i2c_bus_device_t  i2c;
+    struct bme280_dev dev;
+    ReadState         read;
+    bool              present;
+} Bme;
+
+#define BME_INSTANCE(index_, addr_, name_)                   \
+    {.i2c = I2C_BUS_DEVICE(I2C_NUM_0, (addr_), (name_)),      \
+     .dev = {.intf_ptr = &s_bme[index_].i2c,                  \
+             .intf = BME280_I2C_INTF,                         \
+             .read = BME280_I2C_bus_read,                     \
+             .write = BME280_I2C_bus_write,                   \
+             .delay_us = BME280_delay_usek}}
+
+// Index 0 is the primary address (SDO low), index 1 the secondary (SDO high)
+static Bme s_bme[CLIMATE_SENSORS] = {
+    BME_INSTANCE(0, BME280_I2C_ADDR_PRIM, "bme280"),
+    BME_INSTANCE(1, BME280_I2C_ADDR_SEC, "bme280_sec"),
+};
+
+// Delay function for the BME280
+// Yields to the scheduler for whole ticks (which lets the PM light-sleep the chip)
+// and only busy-waits for the sub-tick remainder.
+void BME280_delay_usek(uint32_t usek, void *interface) {
+    int64_t end = esp_timer_get_time() + usek;
+    int64_t remaining = usek;
+
+    while (remaining >= TICK_PERIOD_US) {
+        vTaskDelay(remaining / TICK_PERIOD_US);
+        remaining = end - esp_timer_get_time();
+    }
+    if (remaining > 0) {
+        ets_delay_us(remaining);
+    }
 }
 
-// Helper function to read data from BME280 using I2C
-int8_t BME280_I2C_bus_read(uint8_t reg_addr, uint8_t *reg_data, uint32_t cnt, void *interface) {
-    int8_t           Error;
-    esp_err_t        espRc;
-    i2c_cmd_handle_t cmd = i2c_cmd_link_create();
+// CRC over everything in the cache except the CRC itself
+static uint32_t calib_cache_crc(const CalibCache *cache) {
+    return esp_rom_crc32_le(0, (const uint8_t *)cache, offsetof(CalibCache, crc));
+}
 
-    // Configure and start I2C read sequence
-    i2c_master_start(cmd);
-    i2c_master_write_byte(cmd, (BME280_DEV_ADDR << 1) | I2C_MASTER_WRITE, true);
-    i2c_master_write_byte(cmd, reg_addr, true);
-    i2c_master_start(cmd);
-    i2c_master_write_byte(cmd, (BME280_DEV_ADDR << 1) | I2C_MASTER_READ, true);
+// Apply the cached calibration if it is still valid, returns false if a full init is needed
+static bool calib_cache_restore(int index) {
+    Bme        *bme = &s_bme[index];
+    CalibCache *cache = &s_calib_cache[index];
 
-    // Retrieve data
-    if (cnt > 1) {
-        i2c_master_read(cmd, reg_data, cnt - 1, I2C_MASTER_ACK);
+    if (esp_sleep_get_wakeup_cause() != ESP_SLEEP_WAKEUP_TIMER) {
+        return false;
     }
-    i2c_master_read_byte(cmd, reg_data + cnt - 1, I2C_MASTER_NACK);
-    i2c_master_stop(cmd);
+    if (cache->chip_id != BME280_CHIP_ID || calib_cache_crc(cache) != cache->crc) {
+        ESP_LOGW(TAG, "%s calibration cache invalid", bme->i2c.name);
+        return false;
+    }
+
+    bme->dev.chip_id = cache->chip_id;
+    bme->dev.calib_data = cache->calib_data;
+    return true;
+}
 
-    // Execute the read operation and handle the result
-    espRc = i2c_master_cmd_begin(I2C_NUM_0, cmd, 10 / portTICK_PERIOD_MS);
-    Error = (espRc == ESP_OK) ? BME280_OK : BME280_E_COMM_FAIL;
+// Store the calibration read by bme280_init() for the next wakeup
+static void calib_cache_store(int index) {
+    CalibCache *cache = &s_calib_cache[index];
 
-    i2c_cmd_link_delete(cmd);
-    return Error;
+    memset(cache, 0, sizeof(*cache));
+    cache->chip_id = s_bme[index].dev.chip_id;
+    cache->calib_data = s_bme[index].dev.calib_data;
+    cache->crc = calib_cache_crc(cache);
 }
 
-// Delay function for the BME280
-void BME280_delay_usek(uint32_t msek, void *interface) {
-    ets_delay_us(msek);
+// Compute the register image for the forced-mode profile
+static void profile_image(RegShadow *image) {
+    image->ctrl_hum = BME280_SET_BITS_POS_0(0, BME280_CTRL_HUM, s_profile.osr_h);
+    image->ctrl_meas = BME280_SET_BITS(0, BME280_CTRL_TEMP, s_profile.osr_t);
+    image->ctrl_meas = BME280_SET_BITS(image->ctrl_meas, BME280_CTRL_PRESS, s_profile.osr_p);
+    image->config = BME280_SET_BITS(0, BME280_STANDBY, s_profile.standby_time);
+    image->config = BME280_SET_BITS(image->config, BME280_FILTER, s_profile.filter);
+}
+
+// Typical conversion time of the profile; bme280_cal_meas_delay() gives the worst case
+static uint32_t typical_meas_delay(const struct bme280_settings *settings) {
+    static const uint8_t osr[] = {0, 1, 2, 4, 8, 16};
+
+    uint32_t delay = MEAS_TYP_OFFSET_US + MEAS_TYP_DUR_US * osr[settings->osr_t];
+    if (settings->osr_p) {
+        delay += MEAS_TYP_DUR_US * osr[settings->osr_p] + MEAS_TYP_PH_OFFSET_US;
+    }
+    if (settings->osr_h) {
+        delay += MEAS_TYP_DUR_US * osr[settings->osr_h] + MEAS_TYP_PH_OFFSET_US;
+    }
+    return delay;
+}
+
+// Initialize one BME280, returns false if it does not answer
+static bool init_one(int index) {
+    Bme      *bme = &s_bme[index];
+    RegShadow *shadow = &s_shadow[index];
+    int8_t    rslt;
+
+    i2c_bus_add_device(&bme->i2c);
+
+    if (calib_cache_restore(index)) {
+        ESP_LOGI(TAG, "%s calibration restored from RTC memory", bme->i2c.name);
+        if (shadow->valid) {
+            return true;
+        }
+
+        // Without a trusted shadow, reset to get a known register state
+        rslt = bme280_soft_reset(&bme->dev);
+        ESP_LOGI(TAG, "%s Soft Reset Result: %d", bme->i2c.name, rslt);
+    } else {
+        rslt = bme280_init(&bme->dev);
+        ESP_LOGI(TAG, "%s Init Result: %d", bme->i2c.name, rslt);
+        if (rslt == BME280_OK) {
+            calib_cache_store(index);
+        }
+    }
+
+    // bme280_init() and bme280_soft_reset() leave all control registers at zero
+    memset(shadow, 0, sizeof(*shadow));
+    shadow->valid = (rslt == BME280_OK);
+    return rslt == BME280_OK;
 }
 
-// Initialize BME280 sensor
+// Initialize the BME280s at both addresses
+// The devices are left in sleep mode; all configuration happens in the forced-read write.
+// A cold boot probes both addresses, timer wakeups skip the ones that did not answer.
 void BME_init_wrapper() {
-    int8_t                 rslt;
-    struct bme280_settings settings;
+    if (esp_sleep_get_wakeup_cause() != ESP_SLEEP_WAKEUP_TIMER) {
+        s_absent = 0;
+    }
 
-    rslt = bme280_init(&dev);
-    ESP_LOGI(TAG, "BME280 Init Result: %d", rslt);
+    for (int i = 0; i < CLIMATE_SENSORS; i++) {
+        if (s_absent & (1 << i)) {
+            continue;
+        }
+        s_bme[i].present = init_one(i);
+        if (!s_bme[i].present && esp_sleep_get_wakeup_cause() != ESP_SLEEP_WAKEUP_TIMER) {
+            s_absent |= 1 << i;
+        }
+    }
+}
 
-    rslt = bme280_get_sensor_settings(&settings, &dev);
-    ESP_LOGI(TAG, "BME280 Get Sensor Settings Result: %d", rslt);
+// Finish the asynchronous read and wake up BME_wait_read()
+static void finish_read(Bme *bme, int8_t rslt) {
+    bme->read.rslt = rslt;
+    xSemaphoreGive(bme->read.done);
+}
 
-    settings.osr_h = BME280_OVERSAMPLING_1X;
-    settings.osr_p = BME280_OVERSAMPLING_1X;
-    settings.osr_t = BME280_OVERSAMPLING_1X;
-    settings.filter = BME280_FILTER_COEFF_OFF;
-    settings.standby_time = BME280_STANDBY_TIME_0_5_MS;
+// Submit the next step of the read to the bus task
+static void submit_step(Bme *bme, i2c_bus_op_t op, uint8_t reg_addr, size_t len, i2c_bus_callback_t callback) {
+    bme->read.req.op = op;
+    bme->read.req.reg_addr = reg_addr;
+    bme->read.req.len = len;
+    bme->read.req.callback = callback;
 
-    rslt = bme280_set_sensor_settings(BME280_SEL_ALL_SETTINGS, &settings, &dev);
-    ESP_LOGI(TAG, "BME280 Set Sensor Settings Result: %d", rslt);
+    if (i2c_bus_submit(&bme->read.req) != ESP_OK) {
+        finish_read(bme, BME280_E_COMM_FAIL);
+    }
+}
+
+// Data burst read: compensate and hand the result over
+static void on_data(i2c_bus_request_t *req, esp_err_t err) {
+    Bme                      *bme = req->arg;
+    struct bme280_uncomp_data uncomp;
+    const uint8_t            *raw = bme->read.buffer;
+
+    if (err != ESP_OK) {
+        finish_read(bme, BME280_E_COMM_FAIL);
+        return;
+    }
+
+    // Same layout as the driver's parse_sensor_data(): 20-bit pressure and temperature, 16-bit humidity
+    uncomp.pressure = ((uint32_t)raw[0] << 12) | ((uint32_t)raw[1] << 4) | (raw[2] >> 4);
+    uncomp.temperature = ((uint32_t)raw[3] << 12) | ((uint32_t)raw[4] << 4) | (raw[5] >> 4);
+    uncomp.humidity = ((uint32_t)raw[6] << 8) | raw[7];
+
+    power_lock_cpu();
+    int8_t rslt = bme280_compensate_data(BME280_ALL, &uncomp, &bme->read.data, &bme->dev.calib_data);
+    power_unlock_cpu();
+
+    finish_read(bme, rslt);
+}
+
+// Status read: keep polling until the measuring bit clears or the worst case has passed
+static void on_status(i2c_bus_request_t *req, esp_err_t err) {
+    Bme *bme = req->arg;
+
+    if (err != ESP_OK) {
+        finish_read(bme, BME280_E_COMM_FAIL);
+        return;
+    }
+
+    // BME280_STATUS_MEAS_DONE is the "measuring" bit, set while a conversion runs
+    if ((bme->read.buffer[0] & BME280_STATUS_MEAS_DONE) && esp_timer_get_time() < bme->read.deadline) {
+        esp_timer_start_once(bme->read.timer, POLL_INTERVAL_US);
+        return;
+    }
+    submit_step(bme, I2C_BUS_OP_READ, BME280_REG_DATA, BME280_LEN_P_T_H_DATA, on_data);
+}
+
+// Conversion timer: poll the status register, or read the data once the worst case has passed
+static void on_timer(void *arg) {
+#if BME_POLL_STATUS
+    submit_step(arg, I2C_BUS_OP_READ, BME280_REG_STATUS, 1, on_status);
+#else
+    submit_step(arg, I2C_BUS_OP_READ, BME280_REG_DATA, BME280_LEN_P_T_H_DATA, on_data);
+#endif
+}
+
+// Trigger write: commit the shadow and wait for the conversion without holding the bus
+static void on_triggered(i2c_bus_request_t *req, esp_err_t err) {
+    Bme       *bme = req->arg;
+    RegShadow *shadow = &s_shadow[bme - s_bme];
+    uint32_t   max_delay;
+
+    if (err != ESP_OK) {
+        shadow->valid = 0;
+        finish_read(bme, BME280_E_COMM_FAIL);
+        return;
+    }
 
-    rslt = bme280_set_sensor_mode(BME280_POWERMODE_NORMAL, &dev);
-    ESP_LOGI(TAG, "BME280 Set Sensor Mode Result: %d", rslt);
+    // The device drops back to sleep after the conversion, so the shadow keeps the mode bits clear
+    *shadow = bme->read.image;
+    shadow->valid = 1;
+
+    bme280_cal_meas_delay(&max_delay, &s_profile);
+    bme->read.deadline = esp_timer_get_time() + max_delay;
+#if BME_POLL_STATUS
+    esp_timer_start_once(bme->read.timer, typical_meas_delay(&s_profile));
+#else
+    esp_timer_start_once(bme->read.timer, max_delay);
+#endif
+}
+
+// Start a forced measurement on one device
+// ctrl_hum and config are only written when they differ from a valid shadow. ctrl_meas is always
+// written last in the same burst because it starts the conversion and latches ctrl_hum.
+static esp_err_t start_one(int index) {
+    Bme       *bme = &s_bme[index];
+    ReadState *read = &bme->read;
+    RegShadow *shadow = &s_shadow[index];
+
+    if (read->done == NULL) {
+        esp_timer_create_args_t timer_args = {
+            .callback = on_timer,
+            .arg = bme,
+            .name = bme->i2c.name};
+
+        read->done = xSemaphoreCreateBinary();
+        if (read->done == NULL || esp_timer_create(&timer_args, &read->timer) != ESP_OK) {
+            return ESP_ERR_NO_MEM;
+        }
+        read->req.dev = &bme->i2c;
+        read->req.data = read->buffer;
+        read->req.arg = bme;
+    }
+
+    profile_image(&read->image);
+
+    // Burst writes interleave register addresses and data after the first register
+    // A shadow invalidated by a failed trigger says nothing about the device, write everything.
+    uint8_t first_reg = 0;
+    size_t  len = 0;
+    if (!shadow->valid || read->image.ctrl_hum != shadow->ctrl_hum) {
+        first_reg = BME280_REG_CTRL_HUM;
+        read->buffer[len++] = read->image.ctrl_hum;
+    }
+    if (!shadow->valid || read->image.config != shadow->config) {
+        if (len == 0) {
+            first_reg = BME280_REG_CONFIG;
+        } else {
+            read->buffer[len++] = BME280_REG_CONFIG;
+        }
+        read->buffer[len++] = read->image.config;
+    }
+    if (len == 0) {
+        first_reg = BME280_REG_CTRL_MEAS;
+    } else {
+        read->buffer[len++] = BME280_REG_CTRL_MEAS;
+    }
+    read->buffer[len++] = BME280_SET_BITS_POS_0(read->image.ctrl_meas, BME280_SENSOR_MODE, BME280_POWERMODE_FORCED);
+
+    read->pending = true;
+    submit_step(bme, I2C_BUS_OP_WRITE, first_reg, len, on_triggered);
+    return ESP_OK;
 }
 
-// Read data from BME280 sensor
-int8_t BME_force_read(double *temperature, double *pressure, double *humidity) {
-    int8_t                 rslt;
-    uint32_t               req_delay;
-    struct bme280_data     comp_data;
-    struct bme280_settings settings;
+// Start a forced measurement on every device found at init without blocking
+// The conversions overlap; the bus is free for other devices while they run.
+esp_err_t BME_start_read(void) {
+    esp_err_t ret = ESP_ERR_NOT_FOUND;
 
-    settings.osr_h = BME280_OVERSAMPLING_2X;
-    settings.osr_p = BME280_OVERSAMPLING_2X;
-    settings.osr_t = BME280_OVERSAMPLING_2X;
+    for (int i = 0; i < CLIMATE_SENSORS; i++) {
+        if (!s_bme[i].present) {
+            continue;
+        }
+        esp_err_t err = start_one(i);
+        if (err != ESP_OK) {
+            return err;
+        }
+        ret = ESP_OK;
+    }
+    return ret;
+}
 
-    uint8_t settings_sel = BME280_SEL_OSR_TEMP | BME280_SEL_OSR_HUM | BME280_SEL_OSR_PRESS;
+// Wait for the read of one device started by BME_start_read() and fetch its results
+// Results stay in the driver's fixed-point units, see BME_*_SCALE
+int8_t BME_wait_read(int index, struct bme280_data *data) {
+    Bme *bme = &s_bme[index];
 
-    rslt = bme280_set_sensor_settings(settings_sel, &settings, &dev);
-    ESP_LOGI(TAG, "BME280 Set Sensor Settings Result: %d", rslt);
+    if (!bme->read.pending) {
+        return BME280_E_DEV_NOT_FOUND;
+    }
+    xSemaphoreTake(bme->read.done, portMAX_DELAY);
+    bme->read.pending = false;
 
-    rslt = bme280_cal_meas_delay(&req_delay, &settings);
-    ESP_LOGI(TAG, "BME280 Cal Meas Delay Result: %d", rslt);
+    *data = bme->read.data;
+    ESP_LOGI(TAG, "%s Read Result: %d", bme->i2c.name, bme->read.rslt);
 
-    rslt = bme280_set_sensor_mode(BME280_POWERMODE_FORCED, &dev);
-    ESP_LOGI(TAG, "BME280 Set Sensor Mode Result: %d", rslt);
+    return bme->read.rslt;
+}
 
-    dev.delay_us(req_delay, dev.intf_ptr);
+// Addresses that answered at the last cold boot, as a mask of instance indices
+uint32_t BME_fitted_mask(void) {
+    return ((1 << CLIMATE_SENSORS) - 1) & ~s_absent;
+}
 
-    rslt = bme280_get_sensor_data(BME280_ALL, &comp_data, &dev);
-    ESP_LOGI(TAG, "BME280 Get Sensor Data Result: %d", rslt);
+static esp_err_t sensor_init(void) {
+    BME_init_wrapper();
+    return ESP_OK;
+}
 
-    *temperature = comp_data.temperature;
-    *pressure = comp_data.pressure;
-    *humidity = comp_data.humidity;
+// Every device that answered fills its slot of the climate arrays
+static esp_err_t sensor_read(Sample *sample) {
+    struct bme280_data data;
 
-    return rslt;
+    for (int i = 0; i < CLIMATE_SENSORS; i++) {
+        if (BME_wait_read(i, &data) != BME280_OK) {
+            continue;
+        }
+        sample->temperature[i] = data.temperature;
+        sample->pressure[i] = data.pressure;
+        sample->humidity[i] = data.humidity;
+        sample->climate_mask |= 1 << i;
+        climate_derive(sample, i);
+    }
+    return sample->climate_mask ? ESP_OK : ESP_FAIL;
 }
+
+// Registry entry for both addresses, temperature and humidity drive the limits so the climate is read hourly
+const Sensor BME_sensor = {
+    .name = "bme280",
+    .fields = SAMPLE_CLIMATE,
+    .period_seconds = BME_PERIOD_SECONDS,
+    .cost_ms = 15,
+    .init = sensor_init,
+    .trigger = BME_start_read,
+    .read = sensor_read,
+};
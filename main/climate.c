@@ -0,0 +1,77 @@
+#include "climate.h"
+
+#include <stdint.h>
+
+#include "bme.h"
+
+// Constants and Macros
+#define TABLE_MIN_C   -40
+#define TABLE_STEP    100   // One table entry per degC, in 0.01 degC
+#define KELVIN_OFFSET 27315 // 0 degC in 0.01 K
+
+// Saturation vapour pressure over water in Pa, Magnus formula (Sonntag 1990 coefficients)
+static const uint16_t es_table[] = {
+       19,    21,    23,    26,    29,    32,    35,    38,    42,    47,  // -40 degC
+       51,    56,    62,    68,    74,    81,    89,    97,   106,   116,  // -30 degC
+      126,   137,   149,   163,   177,   192,   208,   226,   245,   265,  // -20 degC
+      287,   310,   336,   363,   391,   422,   455,   490,   528,   568,  // -10 degC
+      611,   657,   706,   758,   813,   872,   934,  1001,  1071,  1146,  // 0 degC
+     1226,  1310,  1400,  1495,  1595,  1702,  1814,  1933,  2059,  2192,  // 10 degC
+     2333,  2481,  2637,  2803,  2977,  3160,  3353,  3557,  3771,  3997,  // 20 degC
+     4234,  4483,  4745,  5020,  5309,  5613,  5931,  6265,  6616,  6983,  // 30 degC
+     7367,  7770,  8192,  8634,  9096,  9580, 10085, 10614, 11166, 11743,  // 40 degC
+    12345, 12974, 13630, 14315, 15029, 15774, 16550, 17359, 18202, 19080,  // 50 degC
+    19993,  // 60 degC
+};
+
+#define TABLE_LEN ((int)(sizeof(es_table) / sizeof(es_table[0])))
+
+// Saturation vapour pressure in 0.01 Pa for a temperature in 0.01 degC
+static uint32_t saturation_pressure(int32_t temperature) {
+    int32_t offset = temperature - TABLE_MIN_C * TABLE_STEP;
+    if (offset <= 0) {
+        return es_table[0] * 100;
+    }
+
+    int index = offset / TABLE_STEP;
+    if (index >= TABLE_LEN - 1) {
+        return es_table[TABLE_LEN - 1] * 100;
+    }
+    int32_t fraction = offset % TABLE_STEP;
+    return es_table[index] * 100 + (es_table[index + 1] - es_table[index]) * fraction;
+}
+
+// Temperature in 0.01 degC at which a vapour pressure in 0.01 Pa saturates
+static int32_t dew_point(uint32_t pressure) {
+    if (pressure <= es_table[0] * 100) {
+        return TABLE_MIN_C * TABLE_STEP;
+    }
+
+    int low = 0, high = TABLE_LEN - 1;
+    while (high - low > 1) {
+        int mid = (low + high) / 2;
+        if (es_table[mid] * 100 <= pressure) {
+            low = mid;
+        } else {
+            high = mid;
+        }
+    }
+    if (pressure >= es_table[high] * 100) {
+        return (TABLE_MIN_C + high) * TABLE_STEP;
+    }
+
+    uint32_t span = (es_table[high] - es_table[low]) * 100;
+    return (TABLE_MIN_C + low) * TABLE_STEP + (int32_t)((pressure - es_table[low] * 100) * TABLE_STEP / span);
+}
+
+// Derive VPD, dew point and absolute humidity from the compensated readings of one BME280
+void climate_derive(Sample *sample, int index) {
+    uint32_t saturation = saturation_pressure(sample->temperature[index]);
+    uint32_t vapour = (uint64_t)saturation * sample->humidity[index] / (100 * BME_HUMIDITY_SCALE);
+
+    sample->vpd[index] = saturation > vapour ? (saturation - vapour + 50) / 100 : 0;
+    sample->dew_point[index] = dew_point(vapour);
+
+    // rho = e * M_w / (R * T), 2167 mg K / (m3 Pa)
+    sample->abs_humidity[index] = (uint64_t)vapour * 2167 / (sample->temperature[index] + KELVIN_OFFSET);
+}
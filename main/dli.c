@@ -0,0 +1,94 @@
+#include "dli.h"
+
+#include <stdint.h>
+
+#include "esp_attr.h"
+#include "esp_log.h"
+
+// Constants and Macros
+#define TAG "DLI"
+
+#define VALID_TIME      1700000000 // Anything earlier means the clock was never synced
+#define MAX_GAP_SECONDS (3 * 3600) // Longer gaps between readings are not interpolated
+#define LUX_TO_PPFD     0.0185     // umol/m2/s per lux, for sunlight
+#define MICRO           1e-6
+
+// Running integral, kept across deep sleep
+typedef struct {
+    time_t last_time; // Time of the previous reading, 0 if none
+    double last_lux;
+    int    day;      // Local day of the running integral, year * 1000 + day of year
+    double today;    // lx*s since local midnight
+    double previous; // lx*s of the last completed day, negative if none
+} DliState;
+
+RTC_DATA_ATTR static DliState s_dli = {.previous = -1};
+
+bool dli_time_valid(time_t now) {
+    return now >= VALID_TIME;
+}
+
+static int local_day(time_t t) {
+    struct tm tm;
+    localtime_r(&t, &tm);
+    return (tm.tm_year + 1900) * 1000 + tm.tm_yday;
+}
+
+// Local midnight at the start of the day containing t
+static time_t local_midnight(time_t t) {
+    struct tm tm;
+    localtime_r(&t, &tm);
+    tm.tm_hour = 0;
+    tm.tm_min = 0;
+    tm.tm_sec = 0;
+    tm.tm_isdst = -1;
+    return mktime(&tm);
+}
+
+// Trapezoid between two readings
+static double area(double lux_a, double lux_b, time_t seconds) {
+    return (lux_a + lux_b) / 2 * seconds;
+}
+
+// Integrate a new reading, splitting the interval at midnight when the day changed
+void dli_add(time_t now, double lux) {
+    if (!dli_time_valid(now)) {
+        return;
+    }
+
+    int day = local_day(now);
+    if (s_dli.last_time == 0 || now <= s_dli.last_time || now - s_dli.last_time > MAX_GAP_SECONDS) {
+        // First reading, clock change or a long outage: restart from this reading
+        if (day != s_dli.day) {
+            s_dli.previous = -1;
+            s_dli.today = 0;
+            s_dli.day = day;
+        }
+    } else if (day != s_dli.day) {
+        time_t midnight = local_midnight(now);
+        double fraction = (double)(midnight - s_dli.last_time) / (now - s_dli.last_time);
+        double lux_midnight = s_dli.last_lux + fraction * (lux - s_dli.last_lux);
+
+        s_dli.today += area(s_dli.last_lux, lux_midnight, midnight - s_dli.last_time);
+        s_dli.previous = s_dli.today;
+        ESP_LOGI(TAG, "Day closed: %.2f mol/m2", s_dli.previous * LUX_TO_PPFD * MICRO);
+
+        s_dli.today = area(lux_midnight, lux, now - midnight);
+        s_dli.day = day;
+    } else {
+        s_dli.today += area(s_dli.last_lux, lux, now - s_dli.last_time);
+    }
+
+    s_dli.last_time = now;
+    s_dli.last_lux = lux;
+}
+
+// Daily light integral in mol/m2 so far today, and of the last full day if there is one
+bool dli_get(double *today, double *previous) {
+    if (s_dli.last_time == 0) {
+        return false;
+    }
+    *today = s_dli.today * LUX_TO_PPFD * MICRO;
+    *previous = s_dli.previous < 0 ? -1 : s_dli.previous * LUX_TO_PPFD * MICRO;
+    return true;
+}
@@ -0,0 +1,313 @@
+#include "history.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bme.h"
+#include "dli.h"
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_partition.h"
+#include "esp_rom_crc.h"
+#include "esp_sleep.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+// Constants and Macros
+#define TAG "HISTORY"
+
+#define PARTITION_SUBTYPE 0x40 // "history" in partitions.csv
+#define SECTOR_SIZE       4096
+#define PER_SECTOR        (SECTOR_SIZE / sizeof(HistoryRecord))
+#define EMPTY_TIMESTAMP   0xFFFFFFFF // Erased flash
+#define CHUNK_RECORDS     PER_SECTOR // Records handed to the socket per chunk
+#define QUERY_MAX         32
+#define DLI_MAX           65.535 // Largest DLI the record holds, sunny summer days can exceed it
+
+// Ring of fixed-size records, oldest first after the write position
+// Records are appended in time order; the sector at the write position is erased just before
+// its first record is written, which drops the oldest PER_SECTOR records once the ring is full.
+static const esp_partition_t *s_partition = NULL;
+static uint32_t               s_total = 0; // Record slots in the partition
+
+// Slot of the next record, kept across deep sleep so only a cold boot has to look for it
+typedef struct {
+    uint32_t head;
+    uint32_t crc;
+} HistoryHead;
+
+RTC_DATA_ATTR static HistoryHead s_head;
+
+// Partition mapped for reading, done once on the first request
+static const HistoryRecord        *s_log = NULL;
+static esp_partition_mmap_handle_t s_map;
+
+// Serialises appends, which erase sectors, with the web server reading them
+static SemaphoreHandle_t s_lock = NULL;
+
+static uint32_t head_crc(const HistoryHead *head) {
+    return esp_rom_crc32_le(0, (const uint8_t *)head, offsetof(HistoryHead, crc));
+}
+
+static void head_set(uint32_t head) {
+    s_head.head = head;
+    s_head.crc = head_crc(&s_head);
+}
+
+static uint32_t slot_timestamp(uint32_t slot) {
+    uint32_t timestamp = EMPTY_TIMESTAMP;
+    esp_partition_read(s_partition, slot * sizeof(HistoryRecord), &timestamp, sizeof(timestamp));
+    return timestamp;
+}
+
+// Find the write position after a cold boot
+// The newest sector is the one whose first record is newest, the head is its first free slot.
+static uint32_t find_head(void) {
+    uint32_t sectors = s_total / PER_SECTOR;
+    uint32_t newest = 0, newest_time = 0;
+    bool     found = false;
+
+    for (uint32_t s = 0; s < sectors; s++) {
+        uint32_t timestamp = slot_timestamp(s * PER_SECTOR);
+        if (timestamp != EMPTY_TIMESTAMP && (!found || timestamp >= newest_time)) {
+            newest = s;
+            newest_time = timestamp;
+            found = true;
+        }
+    }
+    if (!found) {
+        return 0;
+    }
+
+    uint32_t slot = newest * PER_SECTOR;
+    while (slot < (newest + 1) * PER_SECTOR && slot_timestamp(slot) != EMPTY_TIMESTAMP) {
+        slot++;
+    }
+    return slot % s_total;
+}
+
+// Locate the partition and the write position
+esp_err_t history_init(void) {
+    if (s_partition != NULL) {
+        return ESP_OK;
+    }
+
+    if (s_lock == NULL) {
+        s_lock = xSemaphoreCreateMutex();
+    }
+    if (s_lock == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    s_partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, PARTITION_SUBTYPE, "history");
+    if (s_partition == NULL) {
+        ESP_LOGW(TAG, "No history partition");
+        return ESP_ERR_NOT_FOUND;
+    }
+    s_total = s_partition->size / SECTOR_SIZE * PER_SECTOR;
+
+    // Only a timer wakeup continues the same log, anything else may follow a reflash
+    if (esp_sleep_get_wakeup_cause() != ESP_SLEEP_WAKEUP_TIMER || s_head.crc != head_crc(&s_head) ||
+        s_head.head >= s_total) {
+        head_set(find_head());
+        ESP_LOGI(TAG, "Write position %lu of %lu", s_head.head, s_total);
+    }
+    return ESP_OK;
+}
+
+// Compact image of a sample, see HistoryRecord for the units
+static void to_record(const Sample *sample, HistoryRecord *record) {
+    memset(record, 0, sizeof(*record));
+    record->timestamp = sample->timestamp;
+    record->valid = sample->valid;
+    record->moisture_mask = sample->moisture_mask;
+    record->climate_mask = sample->climate_mask;
+    for (int i = 0; i < MOISTURE_PROBES; i++) {
+        record->moisture[i] = (int16_t)(sample->moisture[i] * 100 + 0.5);
+    }
+    for (int i = 0; i < CLIMATE_SENSORS; i++) {
+        record->temperature[i] = sample->temperature[i] * 100 / BME_TEMPERATURE_SCALE;
+        record->humidity[i] = (uint64_t)sample->humidity[i] * 100 / BME_HUMIDITY_SCALE;
+        record->pressure[i] = sample->pressure[i] * 100 / BME_PRESSURE_SCALE;
+        record->vpd[i] = sample->vpd[i];
+    }
+    record->white = (uint32_t)(sample->white * 1000 + 0.5);
+    record->visible = (uint32_t)(sample->visible * 1000 + 0.5);
+    record->dli = sample->dli < DLI_MAX ? (uint16_t)(sample->dli * 1000 + 0.5) : UINT16_MAX;
+    record->battery_mv = sample->battery_mv;
+    record->alerts = sample->alerts;
+    record->crc = esp_rom_crc32_le(0, (const uint8_t *)record, offsetof(HistoryRecord, crc));
+}
+
+// Append one sample to the log
+// Samples taken before the clock was set are left out, they would break the time order.
+void history_append(const Sample *sample) {
+    HistoryRecord record;
+
+    if (s_partition == NULL || !dli_time_valid(sample->timestamp)) {
+        return;
+    }
+
+    to_record(sample, &record);
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+
+    uint32_t  head = s_head.head;
+    esp_err_t err = ESP_OK;
+    if (head % PER_SECTOR == 0) {
+        err = esp_partition_erase_range(s_partition, head * sizeof(HistoryRecord), SECTOR_SIZE);
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "Erase failed: %s", esp_err_to_name(err));
+        }
+    }
+    if (err == ESP_OK) {
+        err = esp_partition_write(s_partition, head * sizeof(HistoryRecord), &record, sizeof(record));
+        if (err == ESP_OK) {
+            head_set((head + 1) % s_total);
+        } else {
+            ESP_LOGE(TAG, "Write failed: %s", esp_err_to_name(err));
+        }
+    }
+
+    xSemaphoreGive(s_lock);
+}
+
+// Oldest record in the ring: the head itself once the ring has wrapped and its sector is still
+// unerased, else the first record of the next sector if that was ever written, else slot 0
+static uint32_t oldest_slot(uint32_t head) {
+    if (s_log[head].timestamp != EMPTY_TIMESTAMP) {
+        return head;
+    }
+    uint32_t next = (head / PER_SECTOR + 1) * PER_SECTOR % s_total;
+    if (next != head - head % PER_SECTOR && s_log[next].timestamp != EMPTY_TIMESTAMP) {
+        return next;
+    }
+    return 0;
+}
+
+// First record at or after since, as an offset from the oldest one
+static uint32_t search(uint32_t oldest, uint32_t count, uint32_t since) {
+    uint32_t low = 0, high = count;
+    while (low < high) {
+        uint32_t mid = low + (high - low) / 2;
+        if (s_log[(oldest + mid) % s_total].timestamp < since) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+// Parse a Unix time made of decimal digits only
+static bool parse_since(const char *value, uint32_t *since) {
+    char *end;
+
+    if (value[0] < '0' || value[0] > '9') {
+        return false;
+    }
+    errno = 0;
+    unsigned long parsed = strtoul(value, &end, 10);
+    if (*end != '\0' || errno == ERANGE) {
+        return false;
+    }
+    *since = parsed;
+    return true;
+}
+
+// Whether the sector holding a slot was erased by the appends made since the head was at snapshot
+// Call with the lock held.
+static bool erased_since(uint32_t snapshot, uint32_t slot) {
+    uint32_t appended = (s_head.head + s_total - snapshot) % s_total;
+    uint32_t sector = slot - slot % PER_SECTOR;
+    return (sector + s_total - snapshot) % s_total < appended;
+}
+
+// Stream the records since a Unix time straight out of the mapped partition
+// The response is the raw HistoryRecord array; each chunk points into flash, nothing is copied.
+// A chunk is one sector and is sent with the lock held, so an append waits for it instead of
+// erasing it mid-send. The response ends early at a sector the ring overwrote meanwhile.
+static esp_err_t history_get_handler(httpd_req_t *req) {
+    char     query[QUERY_MAX], value[16];
+    uint32_t since = 0;
+
+    if (s_log == NULL) {
+        esp_err_t err = esp_partition_mmap(s_partition, 0, s_total * sizeof(HistoryRecord), ESP_PARTITION_MMAP_DATA,
+                                           (const void **)&s_log, &s_map);
+        if (err != ESP_OK) {
+            s_log = NULL;
+            return httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "History unavailable");
+        }
+    }
+
+    // No query or no since sends everything, anything that does not parse is refused
+    esp_err_t err = httpd_req_get_url_query_str(req, query, sizeof(query));
+    if (err == ESP_OK) {
+        err = httpd_query_key_value(query, "since", value, sizeof(value));
+        if (err == ESP_OK && !parse_since(value, &since)) {
+            err = ESP_ERR_INVALID_ARG;
+        }
+    }
+    if (err != ESP_OK && err != ESP_ERR_NOT_FOUND) {
+        return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Expected ?since=<unix time>");
+    }
+
+    // Snapshot the ring, records appended while streaming go out with the next request
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    uint32_t head = s_head.head;
+    uint32_t oldest = oldest_slot(head);
+    uint32_t count = (head + s_total - oldest) % s_total;
+    if (count == 0 && s_log[oldest].timestamp != EMPTY_TIMESTAMP) {
+        count = s_total;
+    }
+    uint32_t first = search(oldest, count, since);
+    xSemaphoreGive(s_lock);
+
+    char version[4];
+    snprintf(version, sizeof(version), "%d", HISTORY_VERSION);
+    httpd_resp_set_type(req, "application/octet-stream");
+    httpd_resp_set_hdr(req, "X-History-Version", version);
+
+    for (uint32_t i = first; i < count;) {
+        uint32_t slot = (oldest + i) % s_total;
+        uint32_t run = count - i;
+
+        // Stop each chunk at the end of the partition and at a sector boundary
+        if (run > s_total - slot) {
+            run = s_total - slot;
+        }
+        if (run > CHUNK_RECORDS - slot % CHUNK_RECORDS) {
+            run = CHUNK_RECORDS - slot % CHUNK_RECORDS;
+        }
+
+        xSemaphoreTake(s_lock, portMAX_DELAY);
+        if (erased_since(head, slot)) {
+            xSemaphoreGive(s_lock);
+            break;
+        }
+        err = httpd_resp_send_chunk(req, (const char *)&s_log[slot], run * sizeof(HistoryRecord));
+        xSemaphoreGive(s_lock);
+        if (err != ESP_OK) {
+            return err;
+        }
+        i += run;
+    }
+    return httpd_resp_send_chunk(req, NULL, 0);
+}
+
+// Serve /history?since=<unix time> on a running web server
+esp_err_t history_register(httpd_handle_t server) {
+    httpd_uri_t history = {
+        .uri = "/history",
+        .method = HTTP_GET,
+        .handler = history_get_handler,
+    };
+
+    if (s_partition == NULL) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    return httpd_register_uri_handler(server, &history);
+}
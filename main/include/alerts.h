@@ -0,0 +1,23 @@
+#ifndef __ALERTS_H__
+#define __ALERTS_H__
+
+#include <stdint.h>
+
+#include "sensors.h"
+#include "wifi.h"
+
+// Bits of the alert mask, one per limited metric
+#define ALERT_MOISTURE     (1 << 0)
+#define ALERT_TEMPERATURE  (1 << 1)
+#define ALERT_HUMIDITY     (1 << 2)
+#define ALERT_PRESSURE     (1 << 3)
+#define ALERT_WHITE        (1 << 4)
+#define ALERT_VISIBLE      (1 << 5)
+#define ALERT_VPD          (1 << 6)
+#define ALERT_DEW_POINT    (1 << 7)
+#define ALERT_ABS_HUMIDITY (1 << 8)
+
+uint32_t alerts_update(const Limits *limits, Sample *sample);
+uint32_t alerts_active(void);
+
+#endif
@@ -0,0 +1,14 @@
+#ifndef __ANALOG_H__
+#define __ANALOG_H__
+
+#include <stdint.h>
+
+#include "hal/adc_types.h"
+#include "esp_err.h"
+
+// Shared ADC1 oneshot unit, so the moisture and battery channels can coexist
+esp_err_t analog_add_channel(adc_channel_t channel);
+esp_err_t analog_read_mv(adc_channel_t channel, int samples, uint32_t *millivolts);
+esp_err_t analog_read_scan(const adc_channel_t *channels, int count, int samples, uint32_t *millivolts);
+
+#endif
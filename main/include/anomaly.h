@@ -0,0 +1,10 @@
+#ifndef __ANOMALY_H__
+#define __ANOMALY_H__
+
+#include <stdbool.h>
+
+#include "sensors.h"
+
+bool anomaly_update(Sample *sample);
+
+#endif
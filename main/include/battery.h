@@ -0,0 +1,20 @@
+#ifndef __BATTERY_H__
+#define __BATTERY_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Supply levels, ordered from healthy to flat
+typedef enum {
+    BATTERY_OK = 0,
+    BATTERY_LOW,      // Stretch the sleep interval, no OTA
+    BATTERY_VERY_LOW, // Additionally batch samples and upload less often
+    BATTERY_CRITICAL, // Never enable the radio
+} BatteryLevel;
+
+void         battery_init(void);
+uint32_t     battery_read_mv(void);
+BatteryLevel battery_level(uint32_t millivolts);
+uint32_t     battery_sleep_factor(BatteryLevel level);
+
+#endif
@@ -4,11 +4,23 @@
 #include <stdint.h>
 
 #include "bme280_defs.h"
+#include "esp_err.h"
+#include "sensors.h"
+
+// Fixed-point units of the compensated readings (BME280_64BIT_ENABLE)
+#define BME_TEMPERATURE_SCALE 100  // 0.01 degC
+#define BME_PRESSURE_SCALE    100  // 0.01 Pa
+#define BME_HUMIDITY_SCALE    1024 // 1/1024 %RH
 
 int8_t BME280_I2C_bus_write(uint8_t reg_addr, const uint8_t *reg_data, uint32_t cnt, void *interface);
 int8_t BME280_I2C_bus_read(uint8_t reg_addr, uint8_t *reg_data, uint32_t cnt, void *interface);
-void   BME280_delay_usek(uint32_t msek, void *interface);
+void   BME280_delay_usek(uint32_t usek, void *interface);
 void   BME_init_wrapper();
-int8_t BME_force_read(double *temperature, double *pressure, double *humidity);
+
+esp_err_t BME_start_read(void);
+int8_t    BME_wait_read(int index, struct bme280_data *data);
+uint32_t  BME_fitted_mask(void);
+
+extern const Sensor BME_sensor;
 
 #endif
\ No newline at end of file
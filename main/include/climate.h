@@ -0,0 +1,13 @@
+#ifndef __CLIMATE_H__
+#define __CLIMATE_H__
+
+#include "sensors.h"
+
+// Fixed-point units of the derived values, relative to the reported units
+#define CLIMATE_VPD_SCALE          1000 // Pa, reported in kPa
+#define CLIMATE_DEW_POINT_SCALE    100  // 0.01 degC
+#define CLIMATE_ABS_HUMIDITY_SCALE 1000 // mg/m3, reported in g/m3
+
+void climate_derive(Sample *sample, int index);
+
+#endif
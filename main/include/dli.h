@@ -0,0 +1,11 @@
+#ifndef __DLI_H__
+#define __DLI_H__
+
+#include <stdbool.h>
+#include <time.h>
+
+bool dli_time_valid(time_t now);
+void dli_add(time_t now, double lux);
+bool dli_get(double *today, double *previous);
+
+#endif
@@ -0,0 +1,39 @@
+#ifndef __HISTORY_H__
+#define __HISTORY_H__
+
+#include <stdint.h>
+
+#include "esp_err.h"
+#include "esp_http_server.h"
+#include "sensors.h"
+
+#define HISTORY_VERSION 1
+
+// One measurement as stored on flash and served by /history, little-endian, 64 bytes
+// A client should drop records whose CRC-32 (over everything before crc) does not match.
+typedef struct __attribute__((packed)) {
+    uint32_t timestamp;                     // Unix time
+    uint16_t valid;                         // SAMPLE_* bits
+    uint8_t  moisture_mask;                 // Bit n set if moisture[n] was measured
+    uint8_t  climate_mask;                  // Bit n set if the climate fields [n] were measured
+    int16_t  moisture[MOISTURE_PROBES];     // 0.01 %
+    int16_t  temperature[CLIMATE_SENSORS];  // 0.01 degC
+    uint16_t humidity[CLIMATE_SENSORS];     // 0.01 %RH
+    uint32_t pressure[CLIMATE_SENSORS];     // 0.01 Pa
+    uint16_t vpd[CLIMATE_SENSORS];          // Pa
+    uint32_t white;                         // 0.001 lx
+    uint32_t visible;                       // 0.001 lx
+    uint16_t dli;                           // 0.001 mol/m2, saturates at 65.535
+    uint16_t battery_mv;
+    uint16_t alerts;                        // ALERT_* bits
+    uint8_t  reserved[10];
+    uint32_t crc;
+} HistoryRecord;
+
+_Static_assert(sizeof(HistoryRecord) == 64, "HistoryRecord must divide the flash sector");
+
+esp_err_t history_init(void);
+void      history_append(const Sample *sample);
+esp_err_t history_register(httpd_handle_t server);
+
+#endif
@@ -1,7 +1,32 @@
 #ifndef __MOISTURE_H__
 #define __MOISTURE_H__
 
-void moisture_init(void);
-void moisture_read(double *moisture);
+#include <stdbool.h>
+#include <stdint.h>
 
-#endif
\ No newline at end of file
+#include "esp_err.h"
+#include "sensors.h"
+
+#define MOISTURE_CAL_POINTS 8
+
+// Piecewise-linear map from probe millivolts to percent, points sorted by millivolts
+typedef struct {
+    uint8_t  count;
+    uint16_t millivolts[MOISTURE_CAL_POINTS];
+    float    percent[MOISTURE_CAL_POINTS];
+} MoistureCal;
+
+// Reference points a capture can record
+typedef enum {
+    MOISTURE_CAPTURE_DRY = 0,
+    MOISTURE_CAPTURE_WET,
+} MoistureCapture;
+
+void      moisture_init(void);
+uint32_t  moisture_fitted_mask(void);
+bool      moisture_cal_valid(const MoistureCal *cal);
+esp_err_t moisture_capture(int probe, MoistureCapture point, MoistureCal *cal);
+
+extern const Sensor moisture_sensor;
+
+#endif
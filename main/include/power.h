@@ -0,0 +1,10 @@
+#ifndef __POWER_H__
+#define __POWER_H__
+
+#include "esp_err.h"
+
+esp_err_t power_init(void);
+void      power_lock_cpu(void);
+void      power_unlock_cpu(void);
+
+#endif
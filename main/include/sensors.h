@@ -0,0 +1,60 @@
+#ifndef __SENSORS_H__
+#define __SENSORS_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "esp_err.h"
+
+// Bits of Sample.valid, one per group of fields a sensor fills
+#define SAMPLE_MOISTURE (1 << 0) // moisture
+#define SAMPLE_CLIMATE  (1 << 1) // temperature, humidity, pressure and the values derived from them
+#define SAMPLE_LIGHT    (1 << 2) // white, visible
+#define SAMPLE_DLI      (1 << 3) // dli, dli_previous
+#define SAMPLE_ALERTS   (1 << 5) // alerts, alert_changes, set only when an alert changed
+#define SAMPLE_URGENT   (1 << 6) // Flag, not a field group: the sample jumped from the recent trend
+
+#define SENSORS_MAX 8
+
+// Instances per kind; the per-instance fields are arrays with a mask of the slots that were filled
+#define CLIMATE_SENSORS 2 // BME280 at the primary and secondary address
+#define MOISTURE_PROBES 4 // Capacitive probes on ADC1 channels
+
+// One set of readings, batched in RTC memory when the upload is deferred
+typedef struct {
+    time_t   timestamp;
+    uint32_t valid; // SAMPLE_* bits of the fields that were measured
+    uint32_t moisture_mask; // Bit n set if moisture[n] was measured
+    double   moisture[MOISTURE_PROBES];
+    uint32_t climate_mask;                  // Bit n set if the climate fields [n] were measured
+    int32_t  temperature[CLIMATE_SENSORS];  // Fixed-point, see BME_TEMPERATURE_SCALE
+    uint32_t humidity[CLIMATE_SENSORS];     // Fixed-point, see BME_HUMIDITY_SCALE
+    uint32_t pressure[CLIMATE_SENSORS];     // Fixed-point, see BME_PRESSURE_SCALE
+    int32_t  vpd[CLIMATE_SENSORS];          // Fixed-point, see CLIMATE_VPD_SCALE
+    int32_t  dew_point[CLIMATE_SENSORS];    // Fixed-point, see CLIMATE_DEW_POINT_SCALE
+    uint32_t abs_humidity[CLIMATE_SENSORS]; // Fixed-point, see CLIMATE_ABS_HUMIDITY_SCALE
+    double   white;
+    double   visible;
+    double   dli;          // Daily light integral so far today, mol/m2
+    double   dli_previous; // Daily light integral of the last full day, negative if none
+    uint32_t battery_mv;    // 0 if the supply was not measured
+    uint32_t alerts;        // ALERT_* bits raised after this sample
+    uint32_t alert_changes; // ALERT_* bits this sample raised or cleared
+} Sample;
+
+// Driver hooks and cadence of one sensor
+typedef struct {
+    const char *name;
+    uint32_t    fields;         // SAMPLE_* bits filled by read()
+    uint32_t    period_seconds; // Minimum time between two readings
+    uint32_t    cost_ms;        // Typical time the sensor keeps the node awake
+    esp_err_t (*init)(void);
+    esp_err_t (*trigger)(void); // Start a conversion, NULL if read() does all the work
+    esp_err_t (*read)(Sample *sample);
+} Sensor;
+
+esp_err_t sensors_register(const Sensor *sensor);
+void      sensors_measure(Sample *sample, bool all);
+
+#endif
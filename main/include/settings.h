@@ -0,0 +1,54 @@
+#ifndef __SETTINGS_H__
+#define __SETTINGS_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+#include "moisture.h"
+#include "wifi.h"
+
+// Bump whenever the layout of Settings changes and add the conversion to migrate()
+#define SETTINGS_VERSION 3
+
+#define SETTINGS_SSID_MAX     33
+#define SETTINGS_PASSWORD_MAX 65
+#define SETTINGS_URL_MAX      128
+
+// Everything configurable on a device, stored as one record
+typedef struct {
+    uint32_t    version;
+    Limits      limits;
+    MoistureCal moisture_cal[MOISTURE_PROBES]; // One table per probe
+    char        ssid[SETTINGS_SSID_MAX];
+    char        password[SETTINGS_PASSWORD_MAX];
+    char        base_url[SETTINGS_URL_MAX];
+    uint32_t    sleep_seconds;   // Deep sleep between measurements on battery
+    uint32_t    stream_interval; // Seconds between uploads in continuous mode
+    uint8_t     i2c_sda;
+    uint8_t     i2c_scl;
+    uint32_t    i2c_freq_hz;
+    uint8_t     continuous;      // Stay awake and stream even without external power
+    uint32_t    crc;
+} Settings;
+
+esp_err_t settings_init(void);
+esp_err_t settings_nvs_init(void);
+
+// Changes are made on a working copy and stored with a single write
+Settings *settings_edit(void);
+esp_err_t settings_commit(void);
+
+const Limits      *settings_limits(void);
+const MoistureCal *settings_moisture_cal(int probe);
+const char        *settings_ssid(void);
+const char        *settings_password(void);
+const char        *settings_base_url(void);
+uint32_t           settings_sleep_seconds(void);
+uint32_t           settings_stream_interval(void);
+uint8_t            settings_i2c_sda(void);
+uint8_t            settings_i2c_scl(void);
+uint32_t           settings_i2c_freq_hz(void);
+bool               settings_continuous(void);
+
+#endif
@@ -0,0 +1,34 @@
+#ifndef __STORE_H__
+#define __STORE_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sensors.h"
+
+#define STORE_FIELDS (9 + MOISTURE_PROBES + 6 * CLIMATE_SENSORS)
+
+// Delta coding state, shared by the encoder and the iterator
+typedef struct {
+    int64_t last_time;
+    int64_t last_delta;
+    int32_t last[STORE_FIELDS];
+} StoreCodec;
+
+// Position of a walk over the stored samples, oldest first
+typedef struct {
+    uint8_t    block;  // Blocks visited so far
+    uint16_t   offset; // Byte offset in the current block
+    uint16_t   index;  // Sample index in the current block
+    StoreCodec codec;
+} StoreIterator;
+
+void   store_append(const Sample *sample);
+size_t store_count(void);
+void   store_clear(void);
+void   store_drop(size_t count);
+void   store_iterate_begin(StoreIterator *it);
+bool   store_iterate(StoreIterator *it, Sample *sample);
+
+#endif
@@ -0,0 +1,12 @@
+#ifndef __TXPOWER_H__
+#define __TXPOWER_H__
+
+#include <stdbool.h>
+
+void txpower_apply(void);
+void txpower_on_retry(void);
+void txpower_on_connected(void);
+void txpower_reset(void);
+void txpower_update(bool delivered);
+
+#endif
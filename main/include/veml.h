@@ -4,8 +4,13 @@
 #include <stdint.h>
 
 #include "esp_err.h"
+#include "sensors.h"
 
 esp_err_t VEML_init();
 esp_err_t VEML_read(double *white, double *visible);
+esp_err_t VEML_start_read(void);
+esp_err_t VEML_wait_read(double *white, double *visible);
+
+extern const Sensor VEML_sensor;
 
 #endif
\ No newline at end of file
@@ -1,6 +1,14 @@
 #ifndef __WIFI_H__
 #define __WIFI_H__
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "esp_err.h"
+#include "sensors.h"
+
 #define WIFI_SSID     "Heimatwinkel WG"
 #define WIFI_PASSWORD "H4w4iiPi$$4"
 
@@ -18,8 +26,17 @@ typedef struct {
     Range pressure;
     Range white;
     Range visible;
+    Range vpd;          // kPa, ignored unless min < max
+    Range dew_point;    // degC, ignored unless min < max
+    Range abs_humidity; // g/m3, ignored unless min < max
 } Limits;
 
-void wifi_init_sta(void);
-void send_data(double* moisture, double* temperature, double* humidity, double* pressure, double* white, double* visible, char* version);
+void      wifi_init_sta(void);
+bool      wifi_ensure_connected(void);
+void      wifi_stream_open(void);
+void      wifi_stream_close(void);
+void      wifi_set_ota_allowed(bool allowed);
+void      wifi_serve_history(void);
+void      wifi_wait_time_sync(void);
+esp_err_t send_data(const Sample* samples, size_t count, const char* version);
 #endif
\ No newline at end of file
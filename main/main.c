@@ -1,98 +1,230 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
+#include "alerts.h"
+#include "anomaly.h"
+#include "battery.h"
 #include "bme.h"
 #include "bme280.h"
 #include "driver/gpio.h"
 #include "driver/i2c.h"
+#include "esp_attr.h"
 #include "esp_err.h"
 #include "esp_log.h"
+#include "esp_rom_sys.h"
 #include "esp_sleep.h"
+#include "esp_wake_stub.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "history.h"
+#include "i2c_bus.h"
 #include "moisture.h"
-#include "nvs_flash.h"
+#include "power.h"
+#include "sensors.h"
+#include "settings.h"
+#include "soc/gpio_reg.h"
+#include "soc/io_mux_reg.h"
+#include "store.h"
 #include "veml.h"
 #include "wifi.h"
 
 // Constants and Macros
 static const char *TAG = "MAIN";
 static const char *VERSION = "1.1.0";
-#define I2C_MASTER_NUM        I2C_NUM_0
-#define I2C_MASTER_SDA_IO     6
-#define I2C_MASTER_SCL_IO     7
-#define I2C_MASTER_FREQ_HZ    100000
-#define I2C_MASTER_TIMEOUT_MS 1000
+#define I2C_MASTER_NUM I2C_NUM_0
 
 #define LED_GPIO           3
-#define SLEEP_TIME_SECONDS 3600
-
-// Function to initialize I2C master
-static esp_err_t i2c_master_init() {
-    i2c_config_t i2c_config = {
-        .mode = I2C_MODE_MASTER,
-        .sda_io_num = I2C_MASTER_SDA_IO,
-        .scl_io_num = I2C_MASTER_SCL_IO,
-        .sda_pullup_en = GPIO_PULLUP_ENABLE,
-        .scl_pullup_en = GPIO_PULLUP_ENABLE,
-        .master.clk_speed = I2C_MASTER_FREQ_HZ};
-    i2c_param_config(I2C_MASTER_NUM, &i2c_config);
-    return i2c_driver_install(I2C_MASTER_NUM, i2c_config.mode, 0, 0, 0);
+#define LED_IO_MUX_REG     IO_MUX_GPIO3_REG // Pad of LED_GPIO, the wake stub cannot use the GPIO driver
+#define TIMEZONE           "CET-1CEST,M3.5.0,M10.5.0/3" // POSIX TZ, sets local midnight for the light integral
+
+// Continuous mode for nodes on USB or mains power, also enabled by "continuous" in the settings
+#define EXT_POWER_GPIO -1 // Reads high while externally powered, -1 if not fitted
+
+// Alert indication during deep sleep, a short blink instead of holding the LED on
+#define ALERT_BLINK_PERIOD_SECONDS 30
+#define ALERT_BLINK_US             20000
+
+// Samples to collect before an upload while the battery is very low
+#define BATCH_SIZE 8
+
+// Stored samples sent per request
+#define UPLOAD_SLICE 16
+
+// Blinks left before the wake that measures again, and the sleep that follows the last one
+RTC_DATA_ATTR static uint32_t s_blinks_left = 0;
+RTC_DATA_ATTR static uint64_t s_final_sleep_us = 0;
+
+// Function to evaluate limits
+// Alerts go through the hysteresis and dwell state machines, the LED shows whether any is raised.
+void evaluate_limits(Limits *limits, Sample *sample) {
+    uint32_t alerts = alerts_update(limits, sample);
+
+    ESP_LOGI(TAG, "Alerts: 0x%03lx", alerts);
+
+    gpio_set_level(LED_GPIO, alerts != 0);
 }
 
-// Function to load limits
-esp_err_t load_limits(Limits *limits) {
-    // Open the NVS handle
-    nvs_handle_t my_handle;
-    esp_err_t    err = nvs_open("storage", NVS_READONLY, &my_handle);
-    if (err != ESP_OK) {
-        return err;
+// Check whether the node runs from USB or mains, or is configured to skip deep sleep anyway
+static bool is_externally_powered(void) {
+    if (settings_continuous()) {
+        return true;
+    }
+    if (EXT_POWER_GPIO < 0) {
+        return false;
     }
 
-    // Load the struct
-    size_t required_size = sizeof(Limits);
-    err = nvs_get_blob(my_handle, "limits", limits, &required_size);
+    gpio_set_direction(EXT_POWER_GPIO, GPIO_MODE_INPUT);
+    gpio_set_pull_mode(EXT_POWER_GPIO, GPIO_PULLDOWN_ONLY);
+    return gpio_get_level(EXT_POWER_GPIO);
+}
+
+// Read the sensors that are due, or all of them, into one sample
+static void measure(Sample *sample, uint32_t battery_mv, bool all) {
+    memset(sample, 0, sizeof(*sample));
+    sample->timestamp = time(NULL);
+    sample->battery_mv = battery_mv;
 
-    // Close the handle
-    nvs_close(my_handle);
-    return err;
+    sensors_measure(sample, all);
+    gpio_set_level(LED_GPIO, 0);
 }
 
-// Function to evaluate limits
-void evaluate_limits(Limits *limits, double moisture, double temperature, double humidity, double pressure, double white, double visible) {
-    int alert = 0;
+// Evaluate the limits against the newest sample, before it is queued so alert changes go out with it
+static void check_limits(Limits *limits, Sample *sample) {
+    *limits = *settings_limits();
+    evaluate_limits(limits, sample);
+}
+
+// Upload every stored sample, oldest first, dropping each slice once the server has it
+// Slices bound the heap needed for the decoded samples and their JSON, whatever the store holds.
+static void upload_stored(void) {
+    Sample *samples = malloc(UPLOAD_SLICE * sizeof(Sample));
+    if (samples == NULL) {
+        ESP_LOGE(TAG, "No memory to upload stored samples");
+        return;
+    }
+
+    while (store_count() > 0) {
+        // A lone sample goes out without its age, so never leave just one for the last slice
+        size_t slice = store_count() == UPLOAD_SLICE + 1 ? UPLOAD_SLICE - 1 : UPLOAD_SLICE;
+
+        StoreIterator it;
+        size_t        decoded = 0;
+        store_iterate_begin(&it);
+        while (decoded < slice && store_iterate(&it, &samples[decoded])) {
+            decoded++;
+        }
+
+        if (decoded == 0) {
+            ESP_LOGE(TAG, "Stored samples unreadable, clearing the store");
+            store_clear();
+        } else if (send_data(samples, decoded, VERSION) == ESP_OK) {
+            store_drop(decoded);
+        } else {
+            break;
+        }
+    }
+    free(samples);
+}
+
+// Stay associated and stream samples over one keep-alive connection
+// Returns once the server switched continuous mode off on a node without external power.
+static void run_continuous(Limits *limits) {
+    ESP_LOGI(TAG, "Running continuously");
+    wifi_init_sta();
+    wifi_stream_open();
+    wifi_serve_history();
+
+    TickType_t last_wake = xTaskGetTickCount();
+    while (1) {
+        Sample sample;
+        measure(&sample, 0, true);
+        check_limits(limits, &sample);
+        history_append(&sample);
 
-    if (moisture < limits->moisture.min || moisture > limits->moisture.max) alert = 1;
-    if (temperature < limits->temperature.min || temperature > limits->temperature.max) alert = 1;
-    if (humidity < limits->humidity.min || humidity > limits->humidity.max) alert = 1;
-    if (pressure < limits->pressure.min || pressure > limits->pressure.max) alert = 1;
-    if (white < limits->white.min || white > limits->white.max) alert = 1;
-    if (visible < limits->visible.min || visible > limits->visible.max) alert = 1;
+        if (wifi_ensure_connected()) {
+            send_data(&sample, 1, VERSION);
+        } else {
+            ESP_LOGW(TAG, "WiFi not connected, skipping upload");
+        }
 
-    ESP_LOGI(TAG, "Alert: %d", alert);
+        if (!is_externally_powered()) {
+            ESP_LOGI(TAG, "Continuous mode switched off");
+            wifi_stream_close();
+            return;
+        }
 
-    gpio_set_level(LED_GPIO, alert);
-    ESP_ERROR_CHECK(gpio_hold_en(LED_GPIO));
-    gpio_deep_sleep_hold_en();
+        // A new interval from the server applies to the wait that follows the upload
+        uint32_t interval = settings_stream_interval();
+        vTaskDelayUntil(&last_wake, pdMS_TO_TICKS(interval * 1000));
+    }
+}
+
+// Runs from RTC memory on each deep-sleep wake while blinks are pending
+// Flashes the LED and goes straight back to sleep, the last segment ends in a normal boot.
+static void RTC_IRAM_ATTR alert_wake_stub(void) {
+    esp_default_wake_deep_sleep();
+    if (s_blinks_left == 0) {
+        return;
+    }
+
+    PIN_FUNC_SELECT(LED_IO_MUX_REG, PIN_FUNC_GPIO);
+    REG_WRITE(GPIO_ENABLE_W1TS_REG, BIT(LED_GPIO));
+    REG_WRITE(GPIO_OUT_W1TS_REG, BIT(LED_GPIO));
+    esp_rom_delay_us(ALERT_BLINK_US);
+    REG_WRITE(GPIO_OUT_W1TC_REG, BIT(LED_GPIO));
+
+    s_blinks_left--;
+    esp_wake_stub_set_wakeup_time(s_blinks_left ? ALERT_BLINK_PERIOD_SECONDS * 1000000ULL : s_final_sleep_us);
+    esp_wake_stub_sleep(&alert_wake_stub);
+}
+
+// Sleep until the next measurement, splitting the sleep into blink periods while an alert is raised
+static void deep_sleep(uint32_t seconds) {
+    uint64_t sleep_us = seconds * 1000000ULL;
+
+    i2c_bus_log_stats();
+    gpio_set_level(LED_GPIO, 0);
+
+    s_blinks_left = 0;
+    if (alerts_active() && seconds > ALERT_BLINK_PERIOD_SECONDS) {
+        s_blinks_left = (seconds - 1) / ALERT_BLINK_PERIOD_SECONDS;
+        s_final_sleep_us = (seconds - s_blinks_left * ALERT_BLINK_PERIOD_SECONDS) * 1000000ULL;
+        sleep_us = ALERT_BLINK_PERIOD_SECONDS * 1000000ULL;
+    }
+
+    esp_set_deep_sleep_wake_stub(&alert_wake_stub);
+    esp_sleep_enable_timer_wakeup(sleep_us);
+    esp_deep_sleep_start();
 }
 
 // Main application function
 void app_main(void) {
     Limits limits;
+    Sample sample;
 
-    // Initialize WiFi
-    esp_err_t ret = nvs_flash_init();
-    if (ret == ESP_ERR_NVS_NO_FREE_PAGES || ret == ESP_ERR_NVS_NEW_VERSION_FOUND) {
-        ESP_ERROR_CHECK(nvs_flash_erase());
-        ret = nvs_flash_init();
-    }
-    ESP_ERROR_CHECK(ret);
-    wifi_init_sta();
+    // NVS is only brought up when the settings or the WiFi driver need it
+    ESP_ERROR_CHECK_WITHOUT_ABORT(settings_init());
+    ESP_ERROR_CHECK_WITHOUT_ABORT(history_init());
+
+    // The environment does not survive deep sleep, the clock itself does
+    setenv("TZ", TIMEZONE, 1);
+    tzset();
+
+    // Scale the CPU down and light sleep while blocked on the network or sensors
+    ESP_ERROR_CHECK_WITHOUT_ABORT(power_init());
 
     // Initialize I2C
-    i2c_master_init();
-    BME_init_wrapper();
-    VEML_init();
+    ESP_ERROR_CHECK(i2c_bus_init(I2C_MASTER_NUM, settings_i2c_sda(), settings_i2c_scl(), settings_i2c_freq_hz()));
+
+    // Sensors are only initialized on the wakes they are read
+    sensors_register(&BME_sensor);
+    sensors_register(&VEML_sensor);
+    sensors_register(&moisture_sensor);
 
     // Initialize other components
-    moisture_init();
+    battery_init();
 
     gpio_deep_sleep_hold_dis();
     gpio_hold_dis(LED_GPIO);
@@ -102,19 +234,33 @@ void app_main(void) {
     gpio_set_direction(1, GPIO_MODE_OUTPUT);
     gpio_set_level(1, 0);
 
-    double moisture = 50, white, visible, temperature, humidity, pressure;
+    if (is_externally_powered()) {
+        run_continuous(&limits);
+        deep_sleep(settings_sleep_seconds());
+    }
 
-    BME_force_read(&temperature, &pressure, &humidity);
-    moisture_read(&moisture);
-    gpio_set_level(LED_GPIO, 0);
-    VEML_read(&white, &visible);
+    // Measure the supply before the radio loads it
+    // Without a reading, save power and skip OTA but keep uploading
+    uint32_t     battery_mv = battery_read_mv();
+    BatteryLevel level = battery_mv ? battery_level(battery_mv) : BATTERY_LOW;
+    uint32_t     sleep_seconds = settings_sleep_seconds() * battery_sleep_factor(level);
+
+    measure(&sample, battery_mv, false);
+    bool urgent = anomaly_update(&sample);
+    check_limits(&limits, &sample);
+    store_append(&sample);
+    history_append(&sample);
 
-    send_data(&moisture, &temperature, &humidity, &pressure, &white, &visible, VERSION);
-    load_limits(&limits);
+    // On a weak battery only upload once the batch is full or something jumped, on a flat one never
+    if (level == BATTERY_CRITICAL || (level == BATTERY_VERY_LOW && store_count() < BATCH_SIZE && !urgent)) {
+        ESP_LOGW(TAG, "Battery level %d, deferring upload (%zu queued)", level, store_count());
+        deep_sleep(sleep_seconds);
+    }
 
-    evaluate_limits(&limits, moisture, temperature, humidity, pressure, white, visible);
+    wifi_set_ota_allowed(level == BATTERY_OK);
+    wifi_init_sta();
+    upload_stored();
+    wifi_wait_time_sync();
 
-    // Sleeping code
-    esp_sleep_enable_timer_wakeup(SLEEP_TIME_SECONDS * 1000000LL);
-    esp_deep_sleep_start();
+    deep_sleep(sleep_seconds);
 }
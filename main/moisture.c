@@ -1,18 +1,176 @@
-#include "driver/adc.h"
+#include "moisture.h"
+
+#include <stdbool.h>
+
+#include "analog.h"
+#include "driver/gpio.h"
 #include "esp_log.h"
+#include "rom/ets_sys.h"
+#include "settings.h"
 
 // Defining constants for clarity
-#define ADC_MAX_VALUE         4095.0
 #define PERCENTAGE_MULTIPLIER 100.0
+#define SAMPLE_COUNT          16
+
+#define MOISTURE_PERIOD_SECONDS 3600 // Minimum time between two readings
+
+// Probe excitation, only powered around the burst to save current and slow corrosion
+// The stock board has no switched probe supply, so the probe stays powered and gating is off
+// until a board routes the supply through a free GPIO.
+#define PROBE_POWER_GPIO -1   // Drives the probe supply, -1 if the probe is always powered
+#define PROBE_SETTLE_US  2000 // Time for the probe output to settle after power-up
 
 // Tag for logging
 #define TAG "MOISTURE"
 
+// ADC1 channel of each fitted probe, the position is the probe index in the payload and settings
+// The stock board has one probe. GPIO1 is the debug ground, GPIO2 the battery divider and GPIO3
+// the LED, so a second probe goes on ADC_CHANNEL_4; more need one of those pins freed.
+static const adc_channel_t s_channels[] = {ADC_CHANNEL_0};
+
+#define PROBE_COUNT ((int)(sizeof(s_channels) / sizeof(s_channels[0])))
+_Static_assert(PROBE_COUNT <= MOISTURE_PROBES, "More probes than Sample.moisture holds");
+
+static bool s_initialized = false;
+
+// A table needs at least two points with strictly increasing millivolts
+bool moisture_cal_valid(const MoistureCal *cal) {
+    if (cal->count < 2 || cal->count > MOISTURE_CAL_POINTS) {
+        return false;
+    }
+    for (int i = 1; i < cal->count; i++) {
+        if (cal->millivolts[i] <= cal->millivolts[i - 1]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Interpolate between the calibration points, clamping outside the table
+static double cal_apply(const MoistureCal *cal, uint32_t millivolts) {
+    if (millivolts <= cal->millivolts[0]) {
+        return cal->percent[0];
+    }
+    for (int i = 1; i < cal->count; i++) {
+        if (millivolts <= cal->millivolts[i]) {
+            double fraction = (double)(millivolts - cal->millivolts[i - 1]) / (cal->millivolts[i] - cal->millivolts[i - 1]);
+            return cal->percent[i - 1] + fraction * (cal->percent[i] - cal->percent[i - 1]);
+        }
+    }
+    return cal->percent[cal->count - 1];
+}
+
+// Sample all probes in one scan with the shared excitation applied only for the duration of the burst
+static esp_err_t probe_read_mv(uint32_t millivolts[PROBE_COUNT]) {
+    if (PROBE_POWER_GPIO >= 0) {
+        gpio_set_level(PROBE_POWER_GPIO, 1);
+        ets_delay_us(PROBE_SETTLE_US);
+    }
+
+    esp_err_t err = analog_read_scan(s_channels, PROBE_COUNT, SAMPLE_COUNT, millivolts);
+
+    if (PROBE_POWER_GPIO >= 0) {
+        gpio_set_level(PROBE_POWER_GPIO, 0);
+    }
+    return err;
+}
+
 void moisture_init(void) {
-    adc1_config_width(ADC_WIDTH_BIT_12);
-    adc1_config_channel_atten(ADC1_CHANNEL_0, ADC_ATTEN_DB_11);
+    if (s_initialized) {
+        return;
+    }
+    for (int i = 0; i < PROBE_COUNT; i++) {
+        ESP_ERROR_CHECK_WITHOUT_ABORT(analog_add_channel(s_channels[i]));
+    }
+
+    if (PROBE_POWER_GPIO >= 0) {
+        gpio_reset_pin(PROBE_POWER_GPIO);
+        gpio_set_direction(PROBE_POWER_GPIO, GPIO_MODE_OUTPUT);
+        gpio_set_level(PROBE_POWER_GPIO, 0);
+    }
+    s_initialized = true;
+}
+
+// Probes listed in s_channels, as a mask of probe indices
+uint32_t moisture_fitted_mask(void) {
+    return (1 << PROBE_COUNT) - 1;
+}
+
+// Record the current reading of one probe as the dry (0 %) or wet (100 %) end of a two-point table
+// The other end is kept from the table passed in, so a dry and a wet capture in any order
+// give a complete table. The caller stores the result.
+esp_err_t moisture_capture(int probe, MoistureCapture point, MoistureCal *cal) {
+    const MoistureCal current = *cal;
+    uint32_t          scan[PROBE_COUNT];
+
+    if (probe < 0 || probe >= PROBE_COUNT) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    // The probe may not have been due for a reading on this wake
+    moisture_init();
+
+    esp_err_t err = probe_read_mv(scan);
+    if (err != ESP_OK) {
+        return err;
+    }
+    uint32_t millivolts = scan[probe];
+
+    // Find the existing dry and wet ends by their percent, whichever way the probe runs
+    int dry = 0, wet = 0;
+    for (int i = 1; i < current.count; i++) {
+        if (current.percent[i] < current.percent[dry]) dry = i;
+        if (current.percent[i] > current.percent[wet]) wet = i;
+    }
+    uint16_t dry_mv = point == MOISTURE_CAPTURE_DRY ? millivolts : current.millivolts[dry];
+    uint16_t wet_mv = point == MOISTURE_CAPTURE_WET ? millivolts : current.millivolts[wet];
+
+    ESP_LOGI(TAG, "Captured probe %d %s at %lu mV", probe, point == MOISTURE_CAPTURE_DRY ? "dry" : "wet", millivolts);
+
+    MoistureCal capture = {.count = 2};
+    if (dry_mv < wet_mv) {
+        capture.millivolts[0] = dry_mv;
+        capture.percent[0] = 0;
+        capture.millivolts[1] = wet_mv;
+        capture.percent[1] = PERCENTAGE_MULTIPLIER;
+    } else {
+        capture.millivolts[0] = wet_mv;
+        capture.percent[0] = PERCENTAGE_MULTIPLIER;
+        capture.millivolts[1] = dry_mv;
+        capture.percent[1] = 0;
+    }
+    if (!moisture_cal_valid(&capture)) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    *cal = capture;
+    return ESP_OK;
+}
+
+static esp_err_t sensor_init(void) {
+    moisture_init();
+    return ESP_OK;
+}
+
+static esp_err_t sensor_read(Sample *sample) {
+    uint32_t  millivolts[PROBE_COUNT];
+    esp_err_t err = probe_read_mv(millivolts);
+    if (err != ESP_OK) {
+        return err;
+    }
+    for (int i = 0; i < PROBE_COUNT; i++) {
+        sample->moisture[i] = cal_apply(settings_moisture_cal(i), millivolts[i]);
+        sample->moisture_mask |= 1 << i;
+    }
+    return ESP_OK;
 }
 
-void moisture_read(double* moisture) {
-    *moisture = (adc1_get_raw(ADC1_CHANNEL_0) / ADC_MAX_VALUE) * PERCENTAGE_MULTIPLIER;
-}
\ No newline at end of file
+// Registry entry for all probes, synchronous: the scan is shorter than queueing it anywhere
+const Sensor moisture_sensor = {
+    .name = "moisture",
+    .fields = SAMPLE_MOISTURE,
+    .period_seconds = MOISTURE_PERIOD_SECONDS,
+    .cost_ms = 3,
+    .init = sensor_init,
+    .trigger = NULL,
+    .read = sensor_read,
+};
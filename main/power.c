@@ -0,0 +1,53 @@
+#include "power.h"
+
+#include "esp_log.h"
+#include "esp_pm.h"
+#include "sdkconfig.h"
+
+// Constants and Macros
+#define TAG              "POWER"
+#define MAX_CPU_FREQ_MHZ CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ
+#define MIN_CPU_FREQ_MHZ CONFIG_XTAL_FREQ
+
+static esp_pm_lock_handle_t s_cpu_lock = NULL;
+
+// Configure frequency scaling and automatic light sleep
+esp_err_t power_init(void) {
+#ifdef CONFIG_PM_ENABLE
+    esp_pm_config_t pm_config = {
+        .max_freq_mhz = MAX_CPU_FREQ_MHZ,
+        .min_freq_mhz = MIN_CPU_FREQ_MHZ,
+        .light_sleep_enable = true};
+
+    esp_err_t err = esp_pm_configure(&pm_config);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "PM configuration failed: %s", esp_err_to_name(err));
+        return err;
+    }
+
+    err = esp_pm_lock_create(ESP_PM_CPU_FREQ_MAX, 0, "cpu_bound", &s_cpu_lock);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "PM lock creation failed: %s", esp_err_to_name(err));
+        return err;
+    }
+
+    ESP_LOGI(TAG, "PM enabled: %d-%d MHz, light sleep on", MIN_CPU_FREQ_MHZ, MAX_CPU_FREQ_MHZ);
+    return ESP_OK;
+#else
+    return ESP_ERR_NOT_SUPPORTED;
+#endif
+}
+
+// Run at full speed until power_unlock_cpu() is called; locks nest
+void power_lock_cpu(void) {
+    if (s_cpu_lock) {
+        esp_pm_lock_acquire(s_cpu_lock);
+    }
+}
+
+// Release the lock taken by power_lock_cpu()
+void power_unlock_cpu(void) {
+    if (s_cpu_lock) {
+        esp_pm_lock_release(s_cpu_lock);
+    }
+}
@@ -0,0 +1,103 @@
+#include "sensors.h"
+
+#include "esp_attr.h"
+#include "esp_log.h"
+
+// Constants and Macros
+#define TAG "SENSORS"
+
+#define PERIOD_SLACK_DIVIDER 10 // Read a sensor up to a tenth of its period early, wakeups drift
+
+static const Sensor *s_sensors[SENSORS_MAX];
+static uint8_t       s_sensor_count = 0;
+static uint32_t      s_initialized = 0; // Sensors initialized since boot
+
+// Time of the last good reading, indexed by registration order
+RTC_DATA_ATTR static time_t   s_last_read[SENSORS_MAX];
+RTC_DATA_ATTR static uint32_t s_ever_read = 0;
+
+// Add a sensor; register them in the same order on every boot, the RTC state is indexed by it
+esp_err_t sensors_register(const Sensor *sensor) {
+    if (s_sensor_count == SENSORS_MAX) {
+        return ESP_ERR_NO_MEM;
+    }
+    s_sensors[s_sensor_count++] = sensor;
+    return ESP_OK;
+}
+
+// Check whether a sensor's period has passed since its last reading
+static bool is_due(int index, time_t now) {
+    if (!(s_ever_read & (1 << index))) {
+        return true;
+    }
+
+    // A clock set backwards also makes the sensor due
+    time_t   elapsed = now - s_last_read[index];
+    uint32_t period = s_sensors[index]->period_seconds;
+    return elapsed < 0 || elapsed + period / PERIOD_SLACK_DIVIDER >= period;
+}
+
+// Pick the due sensors and initialize the ones not yet set up since boot
+static uint32_t plan(time_t now, bool all) {
+    uint32_t due = 0;
+    uint32_t cost_ms = 0;
+
+    for (int i = 0; i < s_sensor_count; i++) {
+        if (!all && !is_due(i, now)) {
+            continue;
+        }
+        if (!(s_initialized & (1 << i))) {
+            if (s_sensors[i]->init() != ESP_OK) {
+                ESP_LOGE(TAG, "%s: init failed", s_sensors[i]->name);
+                continue;
+            }
+            s_initialized |= 1 << i;
+        }
+        due |= 1 << i;
+        cost_ms += s_sensors[i]->cost_ms;
+    }
+
+    ESP_LOGI(TAG, "Reading sensors 0x%02lx, ~%lu ms", due, cost_ms);
+    return due;
+}
+
+// Read one sensor into the sample and remember when it was read
+static void read_one(int index, Sample *sample) {
+    if (s_sensors[index]->read(sample) != ESP_OK) {
+        ESP_LOGE(TAG, "%s: read failed", s_sensors[index]->name);
+        return;
+    }
+    sample->valid |= s_sensors[index]->fields;
+    s_last_read[index] = sample->timestamp;
+    s_ever_read |= 1 << index;
+}
+
+// Read the sensors that are due, or all of them, into a sample
+// Conversions are triggered first so they overlap the synchronous reads.
+void sensors_measure(Sample *sample, bool all) {
+    uint32_t due = plan(sample->timestamp, all);
+    uint32_t pending = 0;
+
+    for (int i = 0; i < s_sensor_count; i++) {
+        if (!(due & (1 << i)) || s_sensors[i]->trigger == NULL) {
+            continue;
+        }
+        if (s_sensors[i]->trigger() == ESP_OK) {
+            pending |= 1 << i;
+        } else {
+            ESP_LOGE(TAG, "%s: trigger failed", s_sensors[i]->name);
+        }
+    }
+
+    for (int i = 0; i < s_sensor_count; i++) {
+        if ((due & (1 << i)) && s_sensors[i]->trigger == NULL) {
+            read_one(i, sample);
+        }
+    }
+
+    for (int i = 0; i < s_sensor_count; i++) {
+        if (pending & (1 << i)) {
+            read_one(i, sample);
+        }
+    }
+}
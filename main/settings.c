@@ -0,0 +1,340 @@
+#include "settings.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_rom_crc.h"
+#include "nvs.h"
+#include "nvs_flash.h"
+
+// Constants and Macros
+#define TAG "SETTINGS"
+
+#define NVS_NAMESPACE "storage"
+#define NVS_KEY       "settings"
+
+// Defaults for a device without a stored record
+#define SLEEP_TIME_SECONDS          3600
+#define CONTINUOUS_INTERVAL_SECONDS 60
+#define I2C_MASTER_SDA_IO           6
+#define I2C_MASTER_SCL_IO           7
+#define I2C_MASTER_FREQ_HZ          100000
+
+// Probe output that reads as 100 % without a calibration, the ADC full scale at 11 dB
+// This matches the raw / 4095 scale of older firmware except for the eFuse correction the
+// ADC calibration now applies, so uncalibrated nodes can read a few percent off their old values.
+#define MOISTURE_RANGE_MV 2500
+
+// Layout of version 1, a single moisture probe
+typedef struct {
+    uint32_t    version;
+    Limits      limits;
+    MoistureCal moisture_cal;
+    char        ssid[SETTINGS_SSID_MAX];
+    char        password[SETTINGS_PASSWORD_MAX];
+    char        base_url[SETTINGS_URL_MAX];
+    uint32_t    sleep_seconds;
+    uint32_t    stream_interval;
+    uint8_t     i2c_sda;
+    uint8_t     i2c_scl;
+    uint32_t    i2c_freq_hz;
+    uint32_t    crc;
+} SettingsV1;
+
+// Layout of version 2, before continuous mode could be configured
+typedef struct {
+    uint32_t    version;
+    Limits      limits;
+    MoistureCal moisture_cal[MOISTURE_PROBES];
+    char        ssid[SETTINGS_SSID_MAX];
+    char        password[SETTINGS_PASSWORD_MAX];
+    char        base_url[SETTINGS_URL_MAX];
+    uint32_t    sleep_seconds;
+    uint32_t    stream_interval;
+    uint8_t     i2c_sda;
+    uint8_t     i2c_scl;
+    uint32_t    i2c_freq_hz;
+    uint32_t    crc;
+} SettingsV2;
+
+// Current record, kept across deep sleep so NVS is only read on a cold boot
+RTC_DATA_ATTR static Settings s_current;
+
+// Working copy handed out by settings_edit()
+static Settings s_pending;
+
+static bool s_nvs_ready = false;
+
+static uint32_t settings_crc(const Settings *settings) {
+    return esp_rom_crc32_le(0, (const uint8_t *)settings, offsetof(Settings, crc));
+}
+
+static bool settings_valid(const Settings *settings) {
+    return settings->version == SETTINGS_VERSION && settings_crc(settings) == settings->crc;
+}
+
+static void settings_defaults(Settings *settings) {
+    memset(settings, 0, sizeof(*settings));
+    settings->version = SETTINGS_VERSION;
+    for (int i = 0; i < MOISTURE_PROBES; i++) {
+        settings->moisture_cal[i] = (MoistureCal){
+            .count = 2,
+            .millivolts = {0, MOISTURE_RANGE_MV},
+            .percent = {0, 100},
+        };
+    }
+    strlcpy(settings->base_url, BASE_URL, sizeof(settings->base_url));
+    settings->sleep_seconds = SLEEP_TIME_SECONDS;
+    settings->stream_interval = CONTINUOUS_INTERVAL_SECONDS;
+    settings->i2c_sda = I2C_MASTER_SDA_IO;
+    settings->i2c_scl = I2C_MASTER_SCL_IO;
+    settings->i2c_freq_hz = I2C_MASTER_FREQ_HZ;
+}
+
+// Import the separate blobs written by firmware before the settings record existed
+static void migrate_legacy(nvs_handle_t handle, Settings *settings) {
+    size_t      size = sizeof(settings->limits);
+    MoistureCal cal;
+
+    if (nvs_get_blob(handle, "limits", &settings->limits, &size) != ESP_OK) {
+        memset(&settings->limits, 0, sizeof(settings->limits));
+    }
+
+    size = sizeof(cal);
+    if (nvs_get_blob(handle, "moisture_cal", &cal, &size) == ESP_OK && size == sizeof(cal)) {
+        settings->moisture_cal[0] = cal;
+    }
+}
+
+// Convert a stored record of any known version into the current layout
+static bool migrate(const uint8_t *blob, size_t size, Settings *settings) {
+    uint32_t version;
+
+    if (size < sizeof(version)) {
+        return false;
+    }
+    memcpy(&version, blob, sizeof(version));
+
+    switch (version) {
+        case SETTINGS_VERSION:
+            if (size != sizeof(Settings)) {
+                return false;
+            }
+            memcpy(settings, blob, size);
+            return settings_crc(settings) == settings->crc;
+
+        case 2: {
+            SettingsV2 v2;
+            if (size != sizeof(v2)) {
+                return false;
+            }
+            memcpy(&v2, blob, size);
+            if (esp_rom_crc32_le(0, (const uint8_t *)&v2, offsetof(SettingsV2, crc)) != v2.crc) {
+                return false;
+            }
+            // Everything but continuous mode, which stays off
+            settings->limits = v2.limits;
+            memcpy(settings->moisture_cal, v2.moisture_cal, sizeof(settings->moisture_cal));
+            memcpy(settings->ssid, v2.ssid, sizeof(settings->ssid));
+            memcpy(settings->password, v2.password, sizeof(settings->password));
+            memcpy(settings->base_url, v2.base_url, sizeof(settings->base_url));
+            settings->sleep_seconds = v2.sleep_seconds;
+            settings->stream_interval = v2.stream_interval;
+            settings->i2c_sda = v2.i2c_sda;
+            settings->i2c_scl = v2.i2c_scl;
+            settings->i2c_freq_hz = v2.i2c_freq_hz;
+            return true;
+        }
+
+        case 1: {
+            SettingsV1 v1;
+            if (size != sizeof(v1)) {
+                return false;
+            }
+            memcpy(&v1, blob, size);
+            if (esp_rom_crc32_le(0, (const uint8_t *)&v1, offsetof(SettingsV1, crc)) != v1.crc) {
+                return false;
+            }
+            // The single probe becomes probe 0, the others keep the defaults
+            settings->limits = v1.limits;
+            settings->moisture_cal[0] = v1.moisture_cal;
+            memcpy(settings->ssid, v1.ssid, sizeof(settings->ssid));
+            memcpy(settings->password, v1.password, sizeof(settings->password));
+            memcpy(settings->base_url, v1.base_url, sizeof(settings->base_url));
+            settings->sleep_seconds = v1.sleep_seconds;
+            settings->stream_interval = v1.stream_interval;
+            settings->i2c_sda = v1.i2c_sda;
+            settings->i2c_scl = v1.i2c_scl;
+            settings->i2c_freq_hz = v1.i2c_freq_hz;
+            return true;
+        }
+
+        default:
+            ESP_LOGW(TAG, "Unknown settings version %lu", version);
+            return false;
+    }
+}
+
+// Make a record current in RAM, independent of whether it reaches NVS
+static void settings_use(Settings *settings) {
+    settings->version = SETTINGS_VERSION;
+    settings->crc = settings_crc(settings);
+    s_current = *settings;
+}
+
+// Initialise the NVS partition on first use
+// A wake that finds the record in RTC memory and stays off the radio never scans the NVS pages.
+esp_err_t settings_nvs_init(void) {
+    if (s_nvs_ready) {
+        return ESP_OK;
+    }
+
+    esp_err_t err = nvs_flash_init();
+    if (err == ESP_ERR_NVS_NO_FREE_PAGES || err == ESP_ERR_NVS_NEW_VERSION_FOUND) {
+        ESP_ERROR_CHECK(nvs_flash_erase());
+        err = nvs_flash_init();
+    }
+    s_nvs_ready = err == ESP_OK;
+    return err;
+}
+
+// Make a record current and write it to NVS
+// A failed write keeps the record in use until the next cold boot, the caller only logs it.
+static esp_err_t settings_store(Settings *settings) {
+    nvs_handle_t handle;
+
+    settings_use(settings);
+
+    esp_err_t err = settings_nvs_init();
+    if (err == ESP_OK) {
+        err = nvs_open(NVS_NAMESPACE, NVS_READWRITE, &handle);
+    }
+    if (err == ESP_OK) {
+        err = nvs_set_blob(handle, NVS_KEY, settings, sizeof(*settings));
+        if (err == ESP_OK) {
+            err = nvs_commit(handle);
+        }
+        nvs_close(handle);
+    }
+
+    if (err == ESP_OK) {
+        ESP_LOGI(TAG, "Settings saved to NVS");
+    } else {
+        ESP_LOGE(TAG, "Saving settings failed: %s", esp_err_to_name(err));
+    }
+    return err;
+}
+
+// Load the record once per boot: from RTC memory after deep sleep, otherwise with one NVS read
+// Whatever happens with NVS, a usable record is current when this returns.
+esp_err_t settings_init(void) {
+    nvs_handle_t handle;
+
+    if (settings_valid(&s_current)) {
+        return ESP_OK;
+    }
+
+    Settings settings;
+    settings_defaults(&settings);
+    settings_use(&settings);
+
+    esp_err_t err = settings_nvs_init();
+    if (err != ESP_OK) {
+        return err;
+    }
+    err = nvs_open(NVS_NAMESPACE, NVS_READONLY, &handle);
+    if (err == ESP_ERR_NVS_NOT_FOUND) {
+        // Nothing was ever stored on this device
+        return ESP_OK;
+    }
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    size_t size = 0;
+    err = nvs_get_blob(handle, NVS_KEY, NULL, &size);
+    if (err == ESP_OK) {
+        uint8_t *blob = malloc(size);
+        if (blob != NULL && nvs_get_blob(handle, NVS_KEY, blob, &size) == ESP_OK && migrate(blob, size, &settings)) {
+            bool current = settings.version == SETTINGS_VERSION && size == sizeof(Settings);
+            free(blob);
+            nvs_close(handle);
+            if (current) {
+                settings_use(&settings);
+                return ESP_OK;
+            }
+            return settings_store(&settings);
+        }
+        free(blob);
+        ESP_LOGE(TAG, "Stored settings unusable, starting from defaults");
+        settings_defaults(&settings);
+    } else {
+        migrate_legacy(handle, &settings);
+    }
+    nvs_close(handle);
+
+    return settings_store(&settings);
+}
+
+Settings *settings_edit(void) {
+    s_pending = s_current;
+    return &s_pending;
+}
+
+// Store the working copy, unless nothing changed
+esp_err_t settings_commit(void) {
+    s_pending.version = SETTINGS_VERSION;
+    s_pending.crc = settings_crc(&s_pending);
+    if (memcmp(&s_pending, &s_current, sizeof(Settings)) == 0) {
+        return ESP_OK;
+    }
+    return settings_store(&s_pending);
+}
+
+const Limits *settings_limits(void) {
+    return &s_current.limits;
+}
+
+const MoistureCal *settings_moisture_cal(int probe) {
+    return &s_current.moisture_cal[probe];
+}
+
+const char *settings_ssid(void) {
+    return s_current.ssid;
+}
+
+const char *settings_password(void) {
+    return s_current.password;
+}
+
+const char *settings_base_url(void) {
+    return s_current.base_url;
+}
+
+uint32_t settings_sleep_seconds(void) {
+    return s_current.sleep_seconds;
+}
+
+uint32_t settings_stream_interval(void) {
+    return s_current.stream_interval;
+}
+
+uint8_t settings_i2c_sda(void) {
+    return s_current.i2c_sda;
+}
+
+uint8_t settings_i2c_scl(void) {
+    return s_current.i2c_scl;
+}
+
+uint32_t settings_i2c_freq_hz(void) {
+    return s_current.i2c_freq_hz;
+}
+
+bool settings_continuous(void) {
+    return s_current.continuous;
+}
@@ -0,0 +1,331 @@
+#include "store.h"
+
+#include <string.h>
+
+#include "esp_attr.h"
+#include "esp_log.h"
+
+// Constants and Macros
+#define TAG "STORE"
+
+#define STORE_BLOCKS     4
+#define STORE_BLOCK_SIZE 512
+#define MAX_RECORD       (2 * 10 + 1 + STORE_FIELDS * 5) // Time, mask and every field at worst-case varint length
+
+// Scales of the fields that are doubles in a Sample
+#define MOISTURE_SCALE 100  // 0.01 %
+#define LUX_SCALE      1000 // 0.001 lx
+#define DLI_SCALE      1000 // 0.001 mol/m2
+
+// Field indices in the integer image of a sample, per-instance fields take one slot per instance
+enum {
+    F_BATTERY = 0,
+    F_MOISTURE_MASK,
+    F_MOISTURE,
+    F_CLIMATE_MASK = F_MOISTURE + MOISTURE_PROBES,
+    F_TEMPERATURE,
+    F_HUMIDITY = F_TEMPERATURE + CLIMATE_SENSORS,
+    F_PRESSURE = F_HUMIDITY + CLIMATE_SENSORS,
+    F_VPD = F_PRESSURE + CLIMATE_SENSORS,
+    F_DEW_POINT = F_VPD + CLIMATE_SENSORS,
+    F_ABS_HUMIDITY = F_DEW_POINT + CLIMATE_SENSORS,
+    F_WHITE = F_ABS_HUMIDITY + CLIMATE_SENSORS,
+    F_VISIBLE,
+    F_DLI,
+    F_DLI_PREVIOUS,
+    F_ALERTS,
+    F_ALERT_CHANGES,
+    F_COUNT,
+};
+
+_Static_assert(F_COUNT == STORE_FIELDS, "STORE_FIELDS out of date");
+
+// Fields written for each valid bit, the battery is always written
+static const struct {
+    uint32_t bit;
+    uint8_t  first;
+    uint8_t  last;
+} s_groups[] = {
+    {0, F_BATTERY, F_BATTERY},
+    {SAMPLE_MOISTURE, F_MOISTURE_MASK, F_MOISTURE + MOISTURE_PROBES - 1},
+    {SAMPLE_CLIMATE, F_CLIMATE_MASK, F_ABS_HUMIDITY + CLIMATE_SENSORS - 1},
+    {SAMPLE_LIGHT, F_WHITE, F_VISIBLE},
+    {SAMPLE_DLI, F_DLI, F_DLI_PREVIOUS},
+    {SAMPLE_ALERTS, F_ALERTS, F_ALERT_CHANGES},
+};
+
+// One independently decodable run of samples, the first one is coded against zero
+typedef struct {
+    uint16_t used;
+    uint16_t count;
+    uint8_t  data[STORE_BLOCK_SIZE];
+} StoreBlock;
+
+RTC_DATA_ATTR static StoreBlock s_blocks[STORE_BLOCKS];
+RTC_DATA_ATTR static uint8_t    s_first = 0; // Oldest block
+RTC_DATA_ATTR static uint8_t    s_used = 0;  // Blocks holding samples
+RTC_DATA_ATTR static StoreCodec s_encoder;   // State after the last sample of the newest block
+RTC_DATA_ATTR static uint16_t   s_skip = 0;  // Samples at the start of the oldest block already dropped
+
+static uint64_t zigzag(int64_t value) {
+    return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+static int64_t unzigzag(uint64_t value) {
+    return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+static size_t put_varint(uint8_t *out, uint64_t value) {
+    size_t len = 0;
+    while (value >= 0x80) {
+        out[len++] = (uint8_t)value | 0x80;
+        value >>= 7;
+    }
+    out[len++] = (uint8_t)value;
+    return len;
+}
+
+static size_t get_varint(const uint8_t *in, size_t size, uint64_t *value) {
+    size_t len = 0;
+    *value = 0;
+    while (len < size && len < 10) {
+        uint8_t byte = in[len];
+        *value |= (uint64_t)(byte & 0x7F) << (7 * len);
+        len++;
+        if (!(byte & 0x80)) {
+            return len;
+        }
+    }
+    return 0;
+}
+
+static int32_t scale(double value, int32_t factor) {
+    return (int32_t)(value * factor + (value < 0 ? -0.5 : 0.5));
+}
+
+// Integer image of a sample in the units listed above
+static void to_fields(const Sample *sample, int32_t *fields) {
+    fields[F_BATTERY] = sample->battery_mv;
+    fields[F_MOISTURE_MASK] = sample->moisture_mask;
+    for (int i = 0; i < MOISTURE_PROBES; i++) {
+        fields[F_MOISTURE + i] = scale(sample->moisture[i], MOISTURE_SCALE);
+    }
+    fields[F_CLIMATE_MASK] = sample->climate_mask;
+    for (int i = 0; i < CLIMATE_SENSORS; i++) {
+        fields[F_TEMPERATURE + i] = sample->temperature[i];
+        fields[F_HUMIDITY + i] = sample->humidity[i];
+        fields[F_PRESSURE + i] = sample->pressure[i];
+        fields[F_VPD + i] = sample->vpd[i];
+        fields[F_DEW_POINT + i] = sample->dew_point[i];
+        fields[F_ABS_HUMIDITY + i] = sample->abs_humidity[i];
+    }
+    fields[F_WHITE] = scale(sample->white, LUX_SCALE);
+    fields[F_VISIBLE] = scale(sample->visible, LUX_SCALE);
+    fields[F_DLI] = scale(sample->dli, DLI_SCALE);
+    fields[F_DLI_PREVIOUS] = scale(sample->dli_previous, DLI_SCALE);
+    fields[F_ALERTS] = sample->alerts;
+    fields[F_ALERT_CHANGES] = sample->alert_changes;
+}
+
+static void from_fields(const int32_t *fields, Sample *sample) {
+    sample->battery_mv = fields[F_BATTERY];
+    for (int i = 0; i < MOISTURE_PROBES; i++) {
+        sample->moisture[i] = (double)fields[F_MOISTURE + i] / MOISTURE_SCALE;
+    }
+    for (int i = 0; i < CLIMATE_SENSORS; i++) {
+        sample->temperature[i] = fields[F_TEMPERATURE + i];
+        sample->humidity[i] = fields[F_HUMIDITY + i];
+        sample->pressure[i] = fields[F_PRESSURE + i];
+        sample->vpd[i] = fields[F_VPD + i];
+        sample->dew_point[i] = fields[F_DEW_POINT + i];
+        sample->abs_humidity[i] = fields[F_ABS_HUMIDITY + i];
+    }
+    sample->white = (double)fields[F_WHITE] / LUX_SCALE;
+    sample->visible = (double)fields[F_VISIBLE] / LUX_SCALE;
+    sample->dli = (double)fields[F_DLI] / DLI_SCALE;
+    sample->dli_previous = (double)fields[F_DLI_PREVIOUS] / DLI_SCALE;
+    sample->alerts = fields[F_ALERTS];
+    sample->alert_changes = fields[F_ALERT_CHANGES];
+    if (sample->valid & SAMPLE_MOISTURE) {
+        sample->moisture_mask = fields[F_MOISTURE_MASK];
+    }
+    if (sample->valid & SAMPLE_CLIMATE) {
+        sample->climate_mask = fields[F_CLIMATE_MASK];
+    }
+}
+
+// Whether a field is written, instances missing from the mask that precedes them are skipped
+static bool field_present(int f, const int32_t *fields) {
+    if (f >= F_MOISTURE && f < F_MOISTURE + MOISTURE_PROBES) {
+        return fields[F_MOISTURE_MASK] & (1 << (f - F_MOISTURE));
+    }
+    if (f >= F_TEMPERATURE && f < F_ABS_HUMIDITY + CLIMATE_SENSORS) {
+        return fields[F_CLIMATE_MASK] & (1 << ((f - F_TEMPERATURE) % CLIMATE_SENSORS));
+    }
+    return true;
+}
+
+// Encode one record: delta-of-delta timestamp, valid mask, then the deltas of the valid fields
+// Unwritten fields keep their last value in the codec, so a sensor skipped on a wake costs nothing.
+static size_t encode(StoreCodec *codec, const Sample *sample, uint8_t *out) {
+    int32_t fields[STORE_FIELDS];
+    size_t  len = 0;
+
+    int64_t delta = sample->timestamp - codec->last_time;
+    len += put_varint(out + len, zigzag(delta - codec->last_delta));
+    codec->last_delta = delta;
+    codec->last_time = sample->timestamp;
+
+    len += put_varint(out + len, sample->valid);
+
+    to_fields(sample, fields);
+    for (size_t g = 0; g < sizeof(s_groups) / sizeof(s_groups[0]); g++) {
+        if (s_groups[g].bit && !(sample->valid & s_groups[g].bit)) {
+            continue;
+        }
+        for (int f = s_groups[g].first; f <= s_groups[g].last; f++) {
+            if (!field_present(f, fields)) {
+                continue;
+            }
+            len += put_varint(out + len, zigzag((int64_t)fields[f] - codec->last[f]));
+            codec->last[f] = fields[f];
+        }
+    }
+    return len;
+}
+
+// Decode one record, returns the bytes consumed or 0 if the record is truncated
+static size_t decode(StoreCodec *codec, const uint8_t *in, size_t size, Sample *sample) {
+    uint64_t value;
+    size_t   len = 0, n;
+
+    memset(sample, 0, sizeof(*sample));
+
+    if ((n = get_varint(in + len, size - len, &value)) == 0) return 0;
+    len += n;
+    codec->last_delta += unzigzag(value);
+    codec->last_time += codec->last_delta;
+    sample->timestamp = codec->last_time;
+
+    if ((n = get_varint(in + len, size - len, &value)) == 0) return 0;
+    len += n;
+    sample->valid = value;
+
+    for (size_t g = 0; g < sizeof(s_groups) / sizeof(s_groups[0]); g++) {
+        if (s_groups[g].bit && !(sample->valid & s_groups[g].bit)) {
+            continue;
+        }
+        for (int f = s_groups[g].first; f <= s_groups[g].last; f++) {
+            if (!field_present(f, codec->last)) {
+                continue;
+            }
+            if ((n = get_varint(in + len, size - len, &value)) == 0) return 0;
+            len += n;
+            codec->last[f] += (int32_t)unzigzag(value);
+        }
+    }
+    from_fields(codec->last, sample);
+    return len;
+}
+
+// Open a fresh block after the newest one, dropping the oldest block when all are in use
+static StoreBlock *next_block(void) {
+    if (s_used == STORE_BLOCKS) {
+        ESP_LOGW(TAG, "Store full, dropping %d samples", s_blocks[s_first].count);
+        s_first = (s_first + 1) % STORE_BLOCKS;
+        s_used--;
+        s_skip = 0;
+    }
+
+    StoreBlock *block = &s_blocks[(s_first + s_used) % STORE_BLOCKS];
+    block->used = 0;
+    block->count = 0;
+    s_used++;
+    memset(&s_encoder, 0, sizeof(s_encoder));
+    return block;
+}
+
+// Append a sample to the newest block, starting a new block when it does not fit
+void store_append(const Sample *sample) {
+    uint8_t     record[MAX_RECORD];
+    StoreCodec  codec = s_encoder;
+    StoreBlock *block = s_used ? &s_blocks[(s_first + s_used - 1) % STORE_BLOCKS] : NULL;
+    size_t      len = encode(&codec, sample, record);
+
+    if (block == NULL || block->used + len > STORE_BLOCK_SIZE) {
+        block = next_block();
+        codec = s_encoder;
+        len = encode(&codec, sample, record);
+    }
+
+    memcpy(block->data + block->used, record, len);
+    block->used += len;
+    block->count++;
+    s_encoder = codec;
+}
+
+size_t store_count(void) {
+    size_t count = 0;
+    for (int i = 0; i < s_used; i++) {
+        count += s_blocks[(s_first + i) % STORE_BLOCKS].count;
+    }
+    return count - s_skip;
+}
+
+void store_clear(void) {
+    s_first = 0;
+    s_used = 0;
+    s_skip = 0;
+    memset(&s_encoder, 0, sizeof(s_encoder));
+}
+
+// Drop the oldest samples, e.g. the ones the server acknowledged
+// Whole blocks are released; within a block the dropped samples are only skipped by the iterator.
+void store_drop(size_t count) {
+    while (s_used > 0 && count > 0) {
+        size_t left = s_blocks[s_first].count - s_skip;
+        if (count < left) {
+            s_skip += count;
+            return;
+        }
+        count -= left;
+        s_first = (s_first + 1) % STORE_BLOCKS;
+        s_used--;
+        s_skip = 0;
+    }
+    if (s_used == 0) {
+        store_clear();
+    }
+}
+
+void store_iterate_begin(StoreIterator *it) {
+    Sample dropped;
+
+    memset(it, 0, sizeof(*it));
+    for (uint16_t i = 0; i < s_skip; i++) {
+        store_iterate(it, &dropped);
+    }
+}
+
+// Decode the next sample, oldest first; returns false after the newest one
+bool store_iterate(StoreIterator *it, Sample *sample) {
+    while (it->block < s_used) {
+        const StoreBlock *block = &s_blocks[(s_first + it->block) % STORE_BLOCKS];
+
+        if (it->index < block->count) {
+            size_t len = decode(&it->codec, block->data + it->offset, block->used - it->offset, sample);
+            if (len > 0) {
+                it->offset += len;
+                it->index++;
+                return true;
+            }
+            ESP_LOGE(TAG, "Corrupt block %d at %d", it->block, it->offset);
+        }
+
+        it->block++;
+        it->offset = 0;
+        it->index = 0;
+        memset(&it->codec, 0, sizeof(it->codec));
+    }
+    return false;
+}
@@ -0,0 +1,133 @@
+#include "txpower.h"
+
+#include <string.h>
+
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_wifi.h"
+
+// Constants and Macros
+#define TAG "TXPOWER"
+
+#define MAX_APS         4
+#define MIN_TX_DBM      2   // esp_wifi_set_max_tx_power accepts 2..20 dBm
+#define MAX_TX_DBM      20
+#define AP_TX_DBM       20  // Assumed AP transmit power, used to estimate our signal at the AP
+#define TARGET_RSSI_DBM -70 // Uplink level that still gives reliable delivery
+#define MARGIN_STEP_DB  3   // Added to the margin for every retry or failed upload
+#define MARGIN_MAX_DB   20
+#define QUARTER_DBM(x)  ((int8_t)((x) * 4))
+
+// Link statistics for one access point, kept across deep sleep
+typedef struct {
+    uint8_t bssid[6];
+    int8_t  tx_dbm;   // Power to use on the next wake, 0 if unknown
+    int8_t  rssi;     // RSSI seen on the last connection
+    uint8_t margin;   // Extra dB on top of the estimate, raised by retries and failures
+    uint8_t retries;  // Connection retries during the last wake
+    uint8_t failures; // Consecutive failed uploads
+} ApStats;
+
+RTC_DATA_ATTR static ApStats s_aps[MAX_APS];
+RTC_DATA_ATTR static int8_t  s_current = -1;
+RTC_DATA_ATTR static uint8_t s_next_slot = 0;
+
+static uint8_t s_retries = 0;
+static int8_t  s_applied_dbm = MAX_TX_DBM;
+
+// Set the radio limit in dBm, clamped to the supported range
+static void set_tx_dbm(int dbm) {
+    if (dbm < MIN_TX_DBM) dbm = MIN_TX_DBM;
+    if (dbm > MAX_TX_DBM) dbm = MAX_TX_DBM;
+
+    esp_err_t err = esp_wifi_set_max_tx_power(QUARTER_DBM(dbm));
+    if (err == ESP_OK) {
+        s_applied_dbm = dbm;
+    } else {
+        ESP_LOGW(TAG, "Setting TX power failed: %s", esp_err_to_name(err));
+    }
+}
+
+// Find the stats slot for a BSSID, claiming the oldest one if it is new
+static int find_ap(const uint8_t *bssid) {
+    for (int i = 0; i < MAX_APS; i++) {
+        if (memcmp(s_aps[i].bssid, bssid, sizeof(s_aps[i].bssid)) == 0) {
+            return i;
+        }
+    }
+
+    int slot = s_next_slot;
+    s_next_slot = (s_next_slot + 1) % MAX_APS;
+    memset(&s_aps[slot], 0, sizeof(ApStats));
+    memcpy(s_aps[slot].bssid, bssid, sizeof(s_aps[slot].bssid));
+    return slot;
+}
+
+// Apply the power chosen for the AP used last wake; call right after esp_wifi_start()
+void txpower_apply(void) {
+    s_retries = 0;
+
+    if (s_current >= 0 && s_aps[s_current].tx_dbm != 0) {
+        set_tx_dbm(s_aps[s_current].tx_dbm);
+        ESP_LOGI(TAG, "Using %d dBm (last RSSI %d dBm)", s_applied_dbm, s_aps[s_current].rssi);
+    } else {
+        set_tx_dbm(MAX_TX_DBM);
+    }
+}
+
+// Go to full power before the driver retries a failed association
+// Stepping up from a reduced power can run out of retries below the level the AP needs, and
+// running out of retries ends in provisioning. The margin for the next wake is raised instead.
+void txpower_on_retry(void) {
+    s_retries++;
+    set_tx_dbm(MAX_TX_DBM);
+}
+
+// Record the AP and its RSSI once the station has an IP
+void txpower_on_connected(void) {
+    wifi_ap_record_t ap_info;
+    if (esp_wifi_sta_get_ap_info(&ap_info) != ESP_OK) {
+        return;
+    }
+
+    s_current = find_ap(ap_info.bssid);
+    s_aps[s_current].rssi = ap_info.rssi;
+    s_aps[s_current].retries = s_retries;
+}
+
+// Forget the reduced powers, every AP starts at full power again
+// Used when no AP could be reached, the stored powers may be what kept the node off the air.
+void txpower_reset(void) {
+    for (int i = 0; i < MAX_APS; i++) {
+        s_aps[i].tx_dbm = 0;
+        s_aps[i].margin = 0;
+    }
+}
+
+// Pick the power for the next wake from this wake's RSSI, retries and upload result
+void txpower_update(bool delivered) {
+    if (s_current < 0) {
+        return;
+    }
+    ApStats *ap = &s_aps[s_current];
+
+    if (!delivered || ap->retries > 0) {
+        ap->margin += MARGIN_STEP_DB * (ap->retries + (delivered ? 0 : 1));
+        if (ap->margin > MARGIN_MAX_DB) ap->margin = MARGIN_MAX_DB;
+        ap->failures = delivered ? 0 : ap->failures + 1;
+    } else {
+        // Clean wake: let the margin decay slowly towards the estimate
+        if (ap->margin > 0) ap->margin--;
+        ap->failures = 0;
+    }
+
+    // Our signal at the AP is roughly its RSSI here, shifted by the difference in transmit power
+    int dbm = TARGET_RSSI_DBM - ap->rssi + AP_TX_DBM + ap->margin;
+    if (ap->failures > 1) dbm = MAX_TX_DBM;
+    if (dbm < MIN_TX_DBM) dbm = MIN_TX_DBM;
+    if (dbm > MAX_TX_DBM) dbm = MAX_TX_DBM;
+    ap->tx_dbm = dbm;
+
+    ESP_LOGI(TAG, "RSSI %d dBm, retries %d, delivered %d -> next TX %d dBm",
+             ap->rssi, ap->retries, delivered, ap->tx_dbm);
+}
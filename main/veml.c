@@ -1,83 +1,282 @@
 #include "veml.h"
 
+#include <stdbool.h>
 #include <stdio.h>
 
-#include "driver/i2c.h"
+#include "dli.h"
 #include "esp_err.h"
 #include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "i2c_bus.h"
 
 // Constants and Macros
 #define I2C_MASTER_NUM I2C_NUM_0
-#define MULTIPLIER     0.00213
+#define MULTIPLIER     0.00213 // lx/count at the most sensitive range: 800 ms, gain x4, DG x2
 #define VEML_DEV_ADDR  0x10
-#define VEML_DG_X2     = (0x01 << 4)
-#define VEML_GAIN_X4   = (0x03 << 2)
+
+// Registers
+#define VEML_REG_CONF  0x00
+#define VEML_REG_WHITE 0x04
+#define VEML_REG_ALS   0x05
+
+// ALS_CONF low byte
+#define VEML_SD     (0x01 << 0)
+#define VEML_IT_POS 4
+
+// ALS_CONF high byte
+#define VEML_GAIN_POS 3
+#define VEML_DG_X2    (0x01 << 5)
+#define VEML_SD0      (0x01 << 7)
+
+// Auto-ranging
+#define MIN_COUNTS      1000  // Probe results above this are precise enough to keep
+#define TARGET_COUNTS   4000  // Aim the final range at least this high
+#define SAT_COUNTS      52000 // Stay clear of the 16-bit ceiling
+#define MAX_SENSITIVITY 128   // 800 ms / 50 ms * gain x4 * DG x2
+
+#define VEML_PERIOD_SECONDS 3600 // Minimum time between two readings
 
 static const char *TAG = "VEML";
 
-// Helper function to write data to VEML using I2C
-esp_err_t VEML_I2C_write(uint8_t reg_addr, uint8_t *reg_data, uint32_t len) {
-    esp_err_t        ret;
-    i2c_cmd_handle_t cmd = i2c_cmd_link_create();
+static i2c_bus_device_t veml_i2c = I2C_BUS_DEVICE(I2C_MASTER_NUM, VEML_DEV_ADDR, "veml");
+
+// Integration time and gain settings, as register field values
+typedef struct {
+    uint8_t it;   // 0 = 50 ms ... 4 = 800 ms
+    uint8_t gain; // 0 = x1, 1 = x2, 3 = x4
+    uint8_t dg;   // 0 = x1, 1 = x2
+} VemlRange;
 
-    i2c_master_start(cmd);
-    i2c_master_write_byte(cmd, (VEML_DEV_ADDR << 1) | I2C_MASTER_WRITE, true);
-    i2c_master_write_byte(cmd, reg_addr, true);
-    i2c_master_write(cmd, reg_data, len, true);
-    i2c_master_stop(cmd);
+static const uint16_t it_ms[] = {50, 100, 200, 400, 800};
+static const uint8_t  gain_factor[] = {1, 2, 0, 4};
+static const uint8_t  gain_fields[] = {0, 1, 3};
 
-    ret = i2c_master_cmd_begin(I2C_MASTER_NUM, cmd, 10 / portTICK_PERIOD_MS);
-    i2c_cmd_link_delete(cmd);
-    return ret;
+// Short, insensitive range used to find out how bright it is
+static const VemlRange s_probe = {.it = 0, .gain = 0, .dg = 0};
+
+// State of the asynchronous read started by VEML_start_read()
+static struct {
+    i2c_bus_request_t  req;
+    uint8_t            buffer[2];
+    VemlRange          range;
+    bool               probing;
+    uint16_t           white;
+    uint16_t           visible;
+    esp_err_t          err;
+    esp_timer_handle_t timer;
+    SemaphoreHandle_t  done;
+} s_read;
+
+// Helper function to write data to VEML using I2C
+esp_err_t VEML_I2C_write(uint8_t reg_addr, uint8_t *reg_data, uint32_t len) {
+    return i2c_bus_write(&veml_i2c, reg_addr, reg_data, len);
 }
 
 // Helper function to read data from VEML using I2C
 esp_err_t VEML_I2C_read(uint8_t reg_addr, uint8_t *reg_data, uint32_t len) {
-    esp_err_t        ret;
-    i2c_cmd_handle_t cmd = i2c_cmd_link_create();
+    return i2c_bus_read(&veml_i2c, reg_addr, reg_data, len);
+}
 
-    i2c_master_start(cmd);
-    i2c_master_write_byte(cmd, (VEML_DEV_ADDR << 1) | I2C_MASTER_WRITE, true);
-    i2c_master_write_byte(cmd, reg_addr, true);
+// Sensitivity of a range relative to the probe range
+static uint32_t sensitivity(const VemlRange *range) {
+    return (it_ms[range->it] / it_ms[0]) * gain_factor[range->gain] * (range->dg ? 2 : 1);
+}
 
-    i2c_master_start(cmd);
-    i2c_master_write_byte(cmd, (VEML_DEV_ADDR << 1) | I2C_MASTER_READ, true);
+// Lux per count for a range, MULTIPLIER scaled from the most sensitive range
+static double resolution(const VemlRange *range) {
+    return MULTIPLIER * MAX_SENSITIVITY / sensitivity(range);
+}
 
-    if (len > 1) {
-        i2c_master_read(cmd, reg_data, len - 1, I2C_MASTER_ACK);
+// Fill the ALS_CONF register value (LSB first) for a range
+static void build_conf(uint8_t *data, const VemlRange *range, bool shutdown) {
+    data[0] = (range->it << VEML_IT_POS) | (shutdown ? VEML_SD : 0);
+    data[1] = (range->gain << VEML_GAIN_POS) | (range->dg ? VEML_DG_X2 : 0) | (shutdown ? VEML_SD0 : 0);
+}
+
+// Pick the shortest integration that brings the probe counts up to the target without saturating
+// Gain is preferred over integration time because it does not lengthen the wake.
+static VemlRange choose_range(uint16_t probe_counts) {
+    VemlRange best = s_probe;
+
+    for (uint8_t it = 0; it < sizeof(it_ms) / sizeof(it_ms[0]); it++) {
+        for (uint8_t dg = 0; dg < 2; dg++) {
+            for (uint8_t g = 0; g < sizeof(gain_fields); g++) {
+                VemlRange candidate = {.it = it, .gain = gain_fields[g], .dg = dg};
+                uint32_t  predicted = (uint32_t)probe_counts * sensitivity(&candidate) / sensitivity(&s_probe);
+
+                if (predicted > SAT_COUNTS) {
+                    continue;
+                }
+                if (predicted >= TARGET_COUNTS) {
+                    return candidate;
+                }
+                if (sensitivity(&candidate) > sensitivity(&best)) {
+                    best = candidate;
+                }
+            }
+        }
     }
-    i2c_master_read_byte(cmd, reg_data + len - 1, I2C_MASTER_NACK);
-    i2c_master_stop(cmd);
+    return best;
+}
 
-    ret = i2c_master_cmd_begin(I2C_MASTER_NUM, cmd, 10 / portTICK_PERIOD_MS);
-    i2c_cmd_link_delete(cmd);
-    return ret;
+// Finish the read and wake up VEML_wait_read()
+static void finish_read(esp_err_t err) {
+    if (err != ESP_OK) {
+        s_read.err = err;
+    }
+    xSemaphoreGive(s_read.done);
+}
+
+// Submit the next step of the read to the bus task
+static void submit_step(i2c_bus_op_t op, uint8_t reg_addr, i2c_bus_callback_t callback) {
+    s_read.req.op = op;
+    s_read.req.reg_addr = reg_addr;
+    s_read.req.callback = callback;
+
+    esp_err_t err = i2c_bus_submit(&s_read.req);
+    if (err != ESP_OK) {
+        finish_read(err);
+    }
+}
+
+// Write the configuration for a range, either measuring or shut down
+static void submit_conf(const VemlRange *range, bool shutdown, i2c_bus_callback_t callback) {
+    build_conf(s_read.buffer, range, shutdown);
+    submit_step(I2C_BUS_OP_WRITE, VEML_REG_CONF, callback);
+}
+
+// Shutdown written: the read is complete
+static void on_shutdown(i2c_bus_request_t *req, esp_err_t err) {
+    finish_read(err);
+}
+
+static void on_configured(i2c_bus_request_t *req, esp_err_t err);
+
+// White channel read: re-range after the probe if needed, otherwise shut down
+static void on_white(i2c_bus_request_t *req, esp_err_t err) {
+    if (err != ESP_OK) {
+        finish_read(err);
+        return;
+    }
+    s_read.white = (s_read.buffer[1] << 8) | s_read.buffer[0];
+
+    if (s_read.probing && s_read.visible < MIN_COUNTS) {
+        s_read.probing = false;
+        s_read.range = choose_range(s_read.visible);
+        if (sensitivity(&s_read.range) > sensitivity(&s_probe)) {
+            submit_conf(&s_read.range, false, on_configured);
+            return;
+        }
+    }
+    submit_conf(&s_read.range, true, on_shutdown);
+}
+
+// Visible channel read
+static void on_visible(i2c_bus_request_t *req, esp_err_t err) {
+    if (err != ESP_OK) {
+        finish_read(err);
+        return;
+    }
+    s_read.visible = (s_read.buffer[1] << 8) | s_read.buffer[0];
+    submit_step(I2C_BUS_OP_READ, VEML_REG_WHITE, on_white);
+}
+
+// Integration window over: read the results
+static void on_timer(void *arg) {
+    submit_step(I2C_BUS_OP_READ, VEML_REG_ALS, on_visible);
+}
+
+// Sensor configured and powered: wait one integration period plus margin
+static void on_configured(i2c_bus_request_t *req, esp_err_t err) {
+    if (err != ESP_OK) {
+        finish_read(err);
+        return;
+    }
+    esp_timer_start_once(s_read.timer, it_ms[s_read.range.it] * 1100 + 2000);
 }
 
 // Initialize VEML sensor
+// The sensor stays shut down between reads.
 esp_err_t VEML_init() {
-    uint8_t data[2] = {0x00, 0b00011101};
-    return VEML_I2C_write(0x00, data, 2);
+    uint8_t data[2];
+
+    i2c_bus_add_device(&veml_i2c);
+
+    build_conf(data, &s_probe, true);
+    return VEML_I2C_write(VEML_REG_CONF, data, 2);
+}
+
+// Power the sensor up with the probe range; the rest of the read runs from callbacks
+esp_err_t VEML_start_read(void) {
+    if (s_read.done == NULL) {
+        esp_timer_create_args_t timer_args = {
+            .callback = on_timer,
+            .name = "veml"};
+
+        s_read.done = xSemaphoreCreateBinary();
+        if (s_read.done == NULL || esp_timer_create(&timer_args, &s_read.timer) != ESP_OK) {
+            return ESP_ERR_NO_MEM;
+        }
+        s_read.req.dev = &veml_i2c;
+        s_read.req.data = s_read.buffer;
+        s_read.req.len = sizeof(s_read.buffer);
+    }
+
+    s_read.err = ESP_OK;
+    s_read.range = s_probe;
+    s_read.probing = true;
+    submit_conf(&s_read.range, false, on_configured);
+    return ESP_OK;
+}
+
+// Wait for the read started by VEML_start_read() and convert it with the final range
+esp_err_t VEML_wait_read(double *white, double *visible) {
+    xSemaphoreTake(s_read.done, portMAX_DELAY);
+    if (s_read.err != ESP_OK) {
+        return s_read.err;
+    }
+
+    double lux_per_count = resolution(&s_read.range);
+    *white = s_read.white * lux_per_count;
+    *visible = s_read.visible * lux_per_count;
+
+    ESP_LOGI(TAG, "Range: %d ms, gain x%d, DG x%d, %.5f lx/count",
+             it_ms[s_read.range.it], gain_factor[s_read.range.gain], s_read.range.dg ? 2 : 1, lux_per_count);
+    return ESP_OK;
 }
 
 // Read data from VEML sensor
 esp_err_t VEML_read(double *white, double *visible) {
-    uint8_t  data[2];
-    uint16_t value;
-
-    esp_err_t ret = VEML_I2C_read(0x04, data, 2);
+    esp_err_t ret = VEML_start_read();
     if (ret != ESP_OK) {
         return ret;
     }
-    value = (data[1] << 8) | data[0];
-    *white = value * MULTIPLIER;
+    return VEML_wait_read(white, visible);
+}
 
-    ret = VEML_I2C_read(0x05, data, 2);
-    if (ret != ESP_OK) {
-        return ret;
+// Light readings also feed the daily light integral, once the clock is synced
+static esp_err_t sensor_read(Sample *sample) {
+    esp_err_t err = VEML_wait_read(&sample->white, &sample->visible);
+    if (err != ESP_OK) {
+        return err;
     }
-    value = (data[1] << 8) | data[0];
-    *visible = value * MULTIPLIER;
 
-    return ret;
+    dli_add(sample->timestamp, sample->visible);
+    if (dli_get(&sample->dli, &sample->dli_previous)) {
+        sample->valid |= SAMPLE_DLI;
+    }
+    return ESP_OK;
 }
+
+// Registry entry, the cost assumes the probe range is kept
+const Sensor VEML_sensor = {
+    .name = "veml3235",
+    .fields = SAMPLE_LIGHT,
+    .period_seconds = VEML_PERIOD_SECONDS,
+    .cost_ms = 60,
+    .init = VEML_init,
+    .trigger = VEML_start_read,
+    .read = sensor_read,
+};
@@ -1,21 +1,30 @@
 #include "wifi.h"
 
+#include "bme.h"
+
 #include <string.h>
 
 #include "cJSON.h"
+#include "climate.h"
+#include "dli.h"
+#include "esp_attr.h"
 #include "esp_event.h"
 #include "esp_http_client.h"
 #include "esp_http_server.h"
 #include "esp_https_ota.h"
 #include "esp_log.h"
 #include "esp_ota_ops.h"
+#include "esp_sntp.h"
 #include "esp_system.h"
 #include "esp_wifi.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/event_groups.h"
 #include "freertos/task.h"
-#include "nvs.h"
-#include "nvs_flash.h"
+#include "history.h"
+#include "moisture.h"
+#include "power.h"
+#include "settings.h"
+#include "txpower.h"
 
 // Constants and Macros
 #define SLEEP_TIME_SECONDS 10
@@ -23,25 +32,44 @@
 #define WIFI_CONNECTED_BIT      BIT0
 #define WIFI_FAIL_BIT           BIT1
 #define WIFI_CREDS_RECEIVED_BIT BIT2
+#define WIFI_TIME_SYNCED_BIT    BIT3
 #define MAXIMUM_RETRY           5
 
-#define URL          BASE_URL "/api/measurements"
-#define FIRMWARE_URL BASE_URL "/api/firmwareupdate"
+#define URL_PATH          "/api/measurements"
+#define FIRMWARE_URL_PATH "/api/firmwareupdate"
+#define MIN_SLEEP_SECONDS 60
 
 #define BUFFSIZE 1024
 
+#define RECONNECT_TIMEOUT_MS  15000
+#define URL_FALLBACK_FAILURES 12 // Failed uploads in a row before a server-set base URL is dropped
+#define SAMPLE_JSON_MAX      512
+
+#define NTP_SERVER                 "pool.ntp.org"
+#define TIME_SYNC_INTERVAL_SECONDS (24 * 3600) // The RTC clock drifts a few seconds per hour in deep sleep
+#define TIME_SYNC_WAIT_MS          5000        // Longest wait before sleep for a clock that was never set
+
 static const char*        TAG = "WiFi";
 static EventGroupHandle_t s_wifi_event_group;
 static int                s_retry_num = 0;
 
-char SSID[32] = "";
-char PASSWORD[64] = "";
+
+// Keep-alive client used in continuous mode, NULL when every upload opens its own connection
+static esp_http_client_handle_t s_stream_client = NULL;
+static bool                     s_ota_allowed = true;
+
+RTC_DATA_ATTR static time_t  s_last_sync = 0;
+RTC_DATA_ATTR static uint8_t s_upload_failures = 0;
 
 // Forward declarations
-void getUpdate(void);
+void      getUpdate(void);
+esp_err_t http_client_event_handler(esp_http_client_event_handle_t evt);
 
 httpd_handle_t server = NULL;
 
+// Web server of continuous mode, separate from the provisioning one above
+static httpd_handle_t s_history_server = NULL;
+
 esp_err_t hello_get_handler(httpd_req_t* req) {
     const char* page =
         ""
@@ -127,9 +155,11 @@ esp_err_t creds_post_handler(httpd_req_t* req) {
         return ESP_FAIL;
     }
 
-    strcpy(SSID, ssid->valuestring);
-    strcpy(PASSWORD, password->valuestring);
+    Settings* settings = settings_edit();
+    strlcpy(settings->ssid, ssid->valuestring, sizeof(settings->ssid));
+    strlcpy(settings->password, password->valuestring, sizeof(settings->password));
     cJSON_Delete(json);
+    ESP_ERROR_CHECK_WITHOUT_ABORT(settings_commit());
 
     httpd_resp_send(req, "OK", HTTPD_RESP_USE_STRLEN);
     xEventGroupSetBits(s_wifi_event_group, WIFI_CREDS_RECEIVED_BIT);
@@ -156,29 +186,54 @@ void init_webserver() {
     }
 }
 
-// Function to save limits
-esp_err_t save_limits(const Limits* limits) {
-    esp_err_t err;
+// Serve the local history to the LAN while the node stays associated
+void wifi_serve_history(void) {
+    httpd_config_t config = HTTPD_DEFAULT_CONFIG();
 
-    // Open the NVS handle
-    nvs_handle_t my_handle;
-    err = nvs_open("storage", NVS_READWRITE, &my_handle);
-    if (err != ESP_OK) {
-        return err;
+    if (s_history_server != NULL) {
+        return;
     }
-
-    // Save the struct
-    err = nvs_set_blob(my_handle, "limits", limits, sizeof(Limits));
-    if (err != ESP_OK) {
-        return err;
+    if (httpd_start(&s_history_server, &config) != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to start the history server");
+        s_history_server = NULL;
+        return;
     }
+    ESP_ERROR_CHECK_WITHOUT_ABORT(history_register(s_history_server));
+}
+
+// Remember when the clock was last set from the network
+static void time_sync_handler(struct timeval* tv) {
+    s_last_sync = tv->tv_sec;
+    ESP_LOGI(TAG, "Time synced");
+    xEventGroupSetBits(s_wifi_event_group, WIFI_TIME_SYNCED_BIT);
+}
 
-    // Commit and close
-    err = nvs_commit(my_handle);
-    nvs_close(my_handle);
+// Start SNTP when the clock has never been set or is due for a correction
+static void time_sync_start(void) {
+    time_t now = time(NULL);
 
-    ESP_LOGI(TAG, "Limits saved to NVS");
-    return err;
+    if (esp_sntp_enabled() || (dli_time_valid(now) && now - s_last_sync < TIME_SYNC_INTERVAL_SECONDS)) {
+        return;
+    }
+    esp_sntp_setoperatingmode(ESP_SNTP_OPMODE_POLL);
+    esp_sntp_setservername(0, NTP_SERVER);
+    sntp_set_time_sync_notification_cb(time_sync_handler);
+    esp_sntp_init();
+}
+
+// Give SNTP a moment to answer before sleeping when the clock has never been set
+// Until it is set the DLI stays invalid and the history skips every sample, so a node that
+// always slept before the reply arrived would never catch up. A set clock is only corrected
+// in the background.
+void wifi_wait_time_sync(void) {
+    if (!esp_sntp_enabled() || dli_time_valid(time(NULL))) {
+        return;
+    }
+    EventBits_t bits = xEventGroupWaitBits(s_wifi_event_group, WIFI_TIME_SYNCED_BIT, pdFALSE, pdFALSE,
+                                           pdMS_TO_TICKS(TIME_SYNC_WAIT_MS));
+    if (!(bits & WIFI_TIME_SYNCED_BIT)) {
+        ESP_LOGW(TAG, "No time sync within %d ms", TIME_SYNC_WAIT_MS);
+    }
 }
 
 // Event handler for WiFi events
@@ -186,7 +241,9 @@ static void event_handler(void* arg, esp_event_base_t event_base, int32_t event_
     if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_START) {
         esp_wifi_connect();
     } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_DISCONNECTED) {
+        xEventGroupClearBits(s_wifi_event_group, WIFI_CONNECTED_BIT);
         if (s_retry_num < MAXIMUM_RETRY) {
+            txpower_on_retry();
             esp_wifi_connect();
             s_retry_num++;
             ESP_LOGI(TAG, "Failed connecting to WiFi. Retrying...");
@@ -198,6 +255,8 @@ static void event_handler(void* arg, esp_event_base_t event_base, int32_t event_
         ip_event_got_ip_t* event = (ip_event_got_ip_t*)event_data;
         ESP_LOGI(TAG, "Connected to IP:" IPSTR, IP2STR(&event->ip_info.ip));
         s_retry_num = 0;
+        txpower_on_connected();
+        time_sync_start();
         xEventGroupSetBits(s_wifi_event_group, WIFI_CONNECTED_BIT);
     }
 }
@@ -209,6 +268,8 @@ void wifi_init_ap() {
 
     wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
     ESP_ERROR_CHECK(esp_wifi_init(&cfg));
+    // Every driver init starts with flash storage, the credentials live in the settings record
+    ESP_ERROR_CHECK(esp_wifi_set_storage(WIFI_STORAGE_RAM));
 
     wifi_config_t wifi_config = {
         .ap = {
@@ -229,8 +290,12 @@ void wifi_init_sta(void) {
     ESP_ERROR_CHECK(esp_event_loop_create_default());
     esp_netif_create_default_wifi_sta();
 
+    // The driver keeps its PHY calibration in NVS
+    ESP_ERROR_CHECK(settings_nvs_init());
     wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
     ESP_ERROR_CHECK(esp_wifi_init(&cfg));
+    // The driver still loads a record older firmware stored, it just no longer writes one
+    ESP_ERROR_CHECK(esp_wifi_set_storage(WIFI_STORAGE_RAM));
 
     // Register event handlers
     esp_event_handler_instance_t instance_any_id;
@@ -238,13 +303,25 @@ void wifi_init_sta(void) {
     ESP_ERROR_CHECK(esp_event_handler_instance_register(WIFI_EVENT, ESP_EVENT_ANY_ID, &event_handler, NULL, &instance_any_id));
     ESP_ERROR_CHECK(esp_event_handler_instance_register(IP_EVENT, IP_EVENT_STA_GOT_IP, &event_handler, NULL, &instance_got_ip));
 
-    // WiFi Configuration
-    wifi_config_t wifi_config;
-    ESP_ERROR_CHECK(esp_wifi_get_config(WIFI_IF_STA, &wifi_config));
+    // WiFi Configuration, the credentials live in the settings record
+    wifi_config_t wifi_config = {0};
+    if (settings_ssid()[0] == '\0') {
+        // Adopt credentials the driver stored for older firmware
+        ESP_ERROR_CHECK(esp_wifi_get_config(WIFI_IF_STA, &wifi_config));
+        Settings* settings = settings_edit();
+        strlcpy(settings->ssid, (const char*)wifi_config.sta.ssid, sizeof(settings->ssid));
+        strlcpy(settings->password, (const char*)wifi_config.sta.password, sizeof(settings->password));
+        ESP_ERROR_CHECK_WITHOUT_ABORT(settings_commit());
+    } else {
+        strlcpy((char*)wifi_config.sta.ssid, settings_ssid(), sizeof(wifi_config.sta.ssid));
+        strlcpy((char*)wifi_config.sta.password, settings_password(), sizeof(wifi_config.sta.password));
+    }
     ESP_LOGI(TAG, "Stored SSID: %s", wifi_config.sta.ssid);
     ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
     ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_STA, &wifi_config));
     ESP_ERROR_CHECK(esp_wifi_start());
+    ESP_ERROR_CHECK(esp_wifi_set_ps(WIFI_PS_MIN_MODEM));
+    txpower_apply();
     ESP_LOGI(TAG, "wifi_init_sta finished. Wait for connection");
     xEventGroupWaitBits(s_wifi_event_group, WIFI_CONNECTED_BIT | WIFI_FAIL_BIT, pdFALSE, pdFALSE, portMAX_DELAY);
     // Check which Bit is set
@@ -252,12 +329,14 @@ void wifi_init_sta(void) {
         ESP_LOGI(TAG, "Connected to AP");
     } else if (xEventGroupGetBits(s_wifi_event_group) & WIFI_FAIL_BIT) {
         ESP_LOGI(TAG, "Failed to connect to AP");
+        txpower_reset();
         xEventGroupClearBits(s_wifi_event_group, WIFI_FAIL_BIT);
         esp_wifi_deinit();
         wifi_init_ap();
         init_webserver();
         xEventGroupWaitBits(s_wifi_event_group, WIFI_CREDS_RECEIVED_BIT, pdFALSE, pdFALSE, portMAX_DELAY);
         httpd_stop(server);
+        server = NULL;
         esp_wifi_stop();
 
         wifi_config_t wifi_config = {
@@ -265,24 +344,50 @@ void wifi_init_sta(void) {
                 .threshold.authmode = WIFI_AUTH_WPA2_PSK,
             },
         };
-        strcpy((char*)wifi_config.sta.ssid, SSID);
-        strcpy((char*)wifi_config.sta.password, PASSWORD);
+        strlcpy((char*)wifi_config.sta.ssid, settings_ssid(), sizeof(wifi_config.sta.ssid));
+        strlcpy((char*)wifi_config.sta.password, settings_password(), sizeof(wifi_config.sta.password));
 
         ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
         ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_STA, &wifi_config));
         ESP_ERROR_CHECK(esp_wifi_start());
+        ESP_ERROR_CHECK(esp_wifi_set_ps(WIFI_PS_MIN_MODEM));
+        txpower_apply();
         ESP_LOGI(TAG, "wifi_init_sta finished. Wait for connection");
         xEventGroupWaitBits(s_wifi_event_group, WIFI_CONNECTED_BIT | WIFI_FAIL_BIT, pdFALSE, pdFALSE, portMAX_DELAY);
     }
 }
 
+// Make sure the station is associated, reconnecting if the link dropped
+bool wifi_ensure_connected(void) {
+    EventBits_t bits = xEventGroupGetBits(s_wifi_event_group);
+    if (bits & WIFI_CONNECTED_BIT) {
+        return true;
+    }
+
+    // The event handler gives up after MAXIMUM_RETRY attempts, start a new round
+    if (bits & WIFI_FAIL_BIT) {
+        xEventGroupClearBits(s_wifi_event_group, WIFI_FAIL_BIT);
+        s_retry_num = 0;
+        esp_wifi_connect();
+    }
+
+    bits = xEventGroupWaitBits(s_wifi_event_group, WIFI_CONNECTED_BIT | WIFI_FAIL_BIT, pdFALSE, pdFALSE, pdMS_TO_TICKS(RECONNECT_TIMEOUT_MS));
+    return bits & WIFI_CONNECTED_BIT;
+}
+
 // Event handler for HTTP events
 esp_err_t http_client_event_handler(esp_http_client_event_handle_t evt) {
     switch (evt->event_id) {
         case HTTP_EVENT_ON_DATA:
             Limits limits = {0};
 
-            cJSON* root = cJSON_Parse(evt->data);
+            power_lock_cpu();
+            cJSON* root = cJSON_ParseWithLength(evt->data, evt->data_len);
+            if (root == NULL) {
+                ESP_LOGW(TAG, "Response is not JSON, ignored");
+                power_unlock_cpu();
+                break;
+            }
 
             cJSON* data_limits = cJSON_GetObjectItem(root, "limits");
 
@@ -322,9 +427,97 @@ esp_err_t http_client_event_handler(esp_http_client_event_handle_t evt) {
                 limits.visible.max = cJSON_GetArrayItem(visible, 1)->valuedouble;
             }
 
+            cJSON* vpd = cJSON_GetObjectItem(data_limits, "vpd");
+            if (vpd) {
+                limits.vpd.min = cJSON_GetArrayItem(vpd, 0)->valuedouble;
+                limits.vpd.max = cJSON_GetArrayItem(vpd, 1)->valuedouble;
+            }
+
+            cJSON* dew_point = cJSON_GetObjectItem(data_limits, "dewPoint");
+            if (dew_point) {
+                limits.dew_point.min = cJSON_GetArrayItem(dew_point, 0)->valuedouble;
+                limits.dew_point.max = cJSON_GetArrayItem(dew_point, 1)->valuedouble;
+            }
+
+            cJSON* abs_humidity = cJSON_GetObjectItem(data_limits, "absHumidity");
+            if (abs_humidity) {
+                limits.abs_humidity.min = cJSON_GetArrayItem(abs_humidity, 0)->valuedouble;
+                limits.abs_humidity.max = cJSON_GetArrayItem(abs_humidity, 1)->valuedouble;
+            }
+
+            // Everything the server tunes goes into the settings record with a single commit
+            // A response without a limits object keeps the current ones
+            Settings* settings = settings_edit();
+            if (cJSON_IsObject(data_limits)) {
+                settings->limits = limits;
+            }
+
+            cJSON* interval = cJSON_GetObjectItem(root, "interval");
+            if (cJSON_IsNumber(interval) && interval->valueint > 0) {
+                settings->stream_interval = interval->valueint;
+            }
+
+            cJSON* sleep_seconds = cJSON_GetObjectItem(root, "sleep");
+            if (cJSON_IsNumber(sleep_seconds) && sleep_seconds->valueint >= MIN_SLEEP_SECONDS) {
+                settings->sleep_seconds = sleep_seconds->valueint;
+            }
+
+            cJSON* continuous = cJSON_GetObjectItem(root, "continuous");
+            if (cJSON_IsBool(continuous)) {
+                settings->continuous = cJSON_IsTrue(continuous);
+            }
+
+            cJSON* base_url = cJSON_GetObjectItem(root, "baseUrl");
+            if (cJSON_IsString(base_url) && strncmp(base_url->valuestring, "http", 4) == 0 &&
+                strlen(base_url->valuestring) < sizeof(settings->base_url)) {
+                strlcpy(settings->base_url, base_url->valuestring, sizeof(settings->base_url));
+            }
+
+            // Calibration and capture apply to one probe, the first unless the server names another
+            int    probe = 0;
+            cJSON* probe_index = cJSON_GetObjectItem(root, "moistureProbe");
+            if (cJSON_IsNumber(probe_index)) {
+                probe = probe_index->valueint;
+            }
+            bool probe_valid = probe >= 0 && probe < MOISTURE_PROBES && (moisture_fitted_mask() & (1 << probe));
+
+            // Moisture calibration as [[millivolts, percent], ...], sorted by millivolts
+            cJSON* calibration = cJSON_GetObjectItem(root, "moistureCalibration");
+            if (cJSON_IsArray(calibration)) {
+                MoistureCal cal = {0};
+                cJSON*      point;
+                cJSON_ArrayForEach(point, calibration) {
+                    if (cal.count == MOISTURE_CAL_POINTS || cJSON_GetArraySize(point) != 2) {
+                        break;
+                    }
+                    cal.millivolts[cal.count] = cJSON_GetArrayItem(point, 0)->valueint;
+                    cal.percent[cal.count] = cJSON_GetArrayItem(point, 1)->valuedouble;
+                    cal.count++;
+                }
+                if (probe_valid && moisture_cal_valid(&cal)) {
+                    settings->moisture_cal[probe] = cal;
+                } else {
+                    ESP_LOGE(TAG, "Moisture calibration rejected");
+                }
+            }
+
+            // Record the probe in its current state as the "dry" or "wet" reference
+            cJSON* capture = cJSON_GetObjectItem(root, "moistureCapture");
+            if (!probe_valid) {
+                ESP_LOGE(TAG, "Moisture probe %d not fitted", probe);
+            } else if (cJSON_IsString(capture) && strcmp(capture->valuestring, "dry") == 0) {
+                ESP_ERROR_CHECK_WITHOUT_ABORT(moisture_capture(probe, MOISTURE_CAPTURE_DRY, &settings->moisture_cal[probe]));
+            } else if (cJSON_IsString(capture) && strcmp(capture->valuestring, "wet") == 0) {
+                ESP_ERROR_CHECK_WITHOUT_ABORT(moisture_capture(probe, MOISTURE_CAPTURE_WET, &settings->moisture_cal[probe]));
+            }
+
+            ESP_ERROR_CHECK_WITHOUT_ABORT(settings_commit());
+
             cJSON* updateAvailable = cJSON_GetObjectItem(root, "updateAvailable");
             if (updateAvailable) {
-                if (cJSON_IsTrue(updateAvailable)) {
+                if (cJSON_IsTrue(updateAvailable) && !s_ota_allowed) {
+                    ESP_LOGW(TAG, "Update available, but skipped on low battery");
+                } else if (cJSON_IsTrue(updateAvailable)) {
                     ESP_LOGI(TAG, "Update available");
                     getUpdate();
                 } else {
@@ -333,7 +526,7 @@ esp_err_t http_client_event_handler(esp_http_client_event_handle_t evt) {
             }
 
             cJSON_Delete(root);
-            ESP_ERROR_CHECK_WITHOUT_ABORT(save_limits(&limits));
+            power_unlock_cpu();
             break;
 
         default:
@@ -342,42 +535,249 @@ esp_err_t http_client_event_handler(esp_http_client_event_handle_t evt) {
     return ESP_OK;
 }
 
-// Function to send data to the server
-void send_data(double* moisture, double* temperature, double* humidity, double* pressure, double* white, double* visible, char* version) {
-    char* data = malloc(150);
-    sprintf(data, "{\"moisture\":%.2f,\"temperature\":%.2f,\"humidity\":%.2f,\"pressure\":%.2f,\"white\":%.5f,\"visible\":%.5f}",
-            *moisture, *temperature, *humidity, *pressure, *white, *visible);
-    ESP_LOGI(TAG, "Sending data: %s", data);
+// Create a client for the measurements endpoint
+static esp_http_client_handle_t http_client_create(void) {
+    char url[SETTINGS_URL_MAX + sizeof(URL_PATH)];
+    snprintf(url, sizeof(url), "%s" URL_PATH, settings_base_url());
 
     esp_http_client_config_t config = {
-        .url = URL,
+        .url = url,
         .method = HTTP_METHOD_POST,
         .cert_pem = NULL,
-        .event_handler = http_client_event_handler};
+        .event_handler = http_client_event_handler,
+        .keep_alive_enable = true};
 
     esp_http_client_handle_t client = esp_http_client_init(&config);
-
     esp_http_client_set_header(client, "Content-Type", "application/json");
+    return client;
+}
+
+// Keep one connection open for all following uploads
+void wifi_stream_open(void) {
+    if (s_stream_client == NULL) {
+        s_stream_client = http_client_create();
+    }
+}
+
+// Close the connection opened by wifi_stream_open()
+void wifi_stream_close(void) {
+    if (s_stream_client != NULL) {
+        esp_http_client_cleanup(s_stream_client);
+        s_stream_client = NULL;
+    }
+}
+
+// Allow or refuse firmware updates offered by the server
+void wifi_set_ota_allowed(bool allowed) {
+    s_ota_allowed = allowed;
+}
+
+// Position after appending written bytes at len, held at the last byte once the output is truncated
+// Keeps size - len positive, so every later append is merely cut short instead of overrunning.
+static int advance(int len, size_t size, int written) {
+    if (written < 0 || (size_t)len + written >= size) {
+        return size - 1;
+    }
+    return len + written;
+}
+
+// Append one metric measured by several instances
+// The shape follows the fitted instances, not the sample: a node with only the first instance
+// fitted sends a plain number, any other node an array indexed by instance with null for
+// the ones that were not measured this time.
+static int format_metric(char* buffer, size_t size, const char* name, uint32_t fitted, uint32_t mask,
+                         const double* values, int decimals) {
+    if (fitted == 1) {
+        return (mask & 1) ? snprintf(buffer, size, "\"%s\":%.*f,", name, decimals, values[0]) : 0;
+    }
+
+    uint32_t slots = fitted | mask;
+    int      len = advance(0, size, snprintf(buffer, size, "\"%s\":[", name));
+    for (int i = 0; slots >> i; i++) {
+        if (mask & (1 << i)) {
+            len = advance(len, size, snprintf(buffer + len, size - len, "%.*f,", decimals, values[i]));
+        } else {
+            len = advance(len, size, snprintf(buffer + len, size - len, "null,"));
+        }
+    }
+    if (len > 0 && buffer[len - 1] == ',') {
+        len--;
+    }
+    len = advance(len, size, snprintf(buffer + len, size - len, "],"));
+    return len;
+}
+
+// Append the climate metrics of every BME280 that was read
+static int format_climate(char* buffer, size_t size, const Sample* sample) {
+    double temperature[CLIMATE_SENSORS], humidity[CLIMATE_SENSORS], pressure[CLIMATE_SENSORS];
+    double vpd[CLIMATE_SENSORS], dew_point[CLIMATE_SENSORS], abs_humidity[CLIMATE_SENSORS];
+    uint32_t fitted = BME_fitted_mask();
+    uint32_t mask = sample->climate_mask;
+
+    for (int i = 0; i < CLIMATE_SENSORS; i++) {
+        temperature[i] = (double)sample->temperature[i] / BME_TEMPERATURE_SCALE;
+        humidity[i] = (double)sample->humidity[i] / BME_HUMIDITY_SCALE;
+        pressure[i] = (double)sample->pressure[i] / BME_PRESSURE_SCALE;
+        vpd[i] = (double)sample->vpd[i] / CLIMATE_VPD_SCALE;
+        dew_point[i] = (double)sample->dew_point[i] / CLIMATE_DEW_POINT_SCALE;
+        abs_humidity[i] = (double)sample->abs_humidity[i] / CLIMATE_ABS_HUMIDITY_SCALE;
+    }
+
+    int len = advance(0, size, format_metric(buffer, size, "temperature", fitted, mask, temperature, 2));
+    len = advance(len, size, format_metric(buffer + len, size - len, "humidity", fitted, mask, humidity, 2));
+    len = advance(len, size, format_metric(buffer + len, size - len, "pressure", fitted, mask, pressure, 2));
+    len = advance(len, size, format_metric(buffer + len, size - len, "vpd", fitted, mask, vpd, 3));
+    len = advance(len, size, format_metric(buffer + len, size - len, "dewPoint", fitted, mask, dew_point, 2));
+    len = advance(len, size, format_metric(buffer + len, size - len, "absHumidity", fitted, mask, abs_humidity, 2));
+    return len;
+}
+
+// Append one sample as a JSON object, with its age when it was batched
+// Returns -1 when the object does not fit, the buffer then holds no usable JSON.
+static int format_sample(char* buffer, size_t size, const Sample* sample, time_t now, bool with_age) {
+    int len = advance(0, size, snprintf(buffer, size, "{"));
+    if ((sample->valid & SAMPLE_MOISTURE) && sample->moisture_mask) {
+        len = advance(len, size,
+                      format_metric(buffer + len, size - len, "moisture", moisture_fitted_mask(),
+                                    sample->moisture_mask, sample->moisture, 2));
+    }
+    if ((sample->valid & SAMPLE_CLIMATE) && sample->climate_mask) {
+        len = advance(len, size, format_climate(buffer + len, size - len, sample));
+    }
+    if (sample->valid & SAMPLE_LIGHT) {
+        len = advance(len, size, snprintf(buffer + len, size - len, "\"white\":%.5f,\"visible\":%.5f,",
+                                          sample->white, sample->visible));
+    }
+    if (sample->valid & SAMPLE_DLI) {
+        len = advance(len, size, snprintf(buffer + len, size - len, "\"dli\":%.3f,", sample->dli));
+        if (sample->dli_previous >= 0) {
+            len = advance(len, size,
+                          snprintf(buffer + len, size - len, "\"dliPrevious\":%.3f,", sample->dli_previous));
+        }
+    }
+    if (sample->valid & SAMPLE_ALERTS) {
+        len = advance(len, size, snprintf(buffer + len, size - len, "\"alerts\":%lu,\"alertChanges\":%lu,",
+                                          sample->alerts, sample->alert_changes));
+    }
+    if (sample->valid & SAMPLE_URGENT) {
+        len = advance(len, size, snprintf(buffer + len, size - len, "\"urgent\":true,"));
+    }
+    if (sample->battery_mv) {
+        len = advance(len, size, snprintf(buffer + len, size - len, "\"battery\":%lu,", sample->battery_mv));
+    }
+    if (with_age) {
+        len = advance(len, size,
+                      snprintf(buffer + len, size - len, "\"age\":%lld,", (long long)(now - sample->timestamp)));
+    }
+
+    // Drop the trailing separator, sensors that were not due are left out
+    if (len > 0 && buffer[len - 1] == ',') {
+        len--;
+    }
+    len = advance(len, size, snprintf(buffer + len, size - len, "}"));
+
+    // Held at the last byte means the output was cut short somewhere
+    return (size_t)len + 1 < size ? len : -1;
+}
+
+// Go back to the built-in server after a run of failed uploads to a URL the server pushed
+// A mistyped base URL would otherwise cut the node off from the only channel that can fix it.
+static void base_url_update(bool delivered) {
+    if (delivered || strcmp(settings_base_url(), BASE_URL) == 0) {
+        s_upload_failures = 0;
+        return;
+    }
+    if (++s_upload_failures < URL_FALLBACK_FAILURES) {
+        return;
+    }
+
+    ESP_LOGW(TAG, "%d uploads to %s failed, returning to %s", s_upload_failures, settings_base_url(), BASE_URL);
+    Settings* settings = settings_edit();
+    strlcpy(settings->base_url, BASE_URL, sizeof(settings->base_url));
+    ESP_ERROR_CHECK_WITHOUT_ABORT(settings_commit());
+    s_upload_failures = 0;
+
+    // The keep-alive client was created for the old URL
+    if (s_stream_client != NULL) {
+        wifi_stream_close();
+        wifi_stream_open();
+    }
+}
+
+// Function to send data to the server
+// A single sample is sent as an object, a batch as an array of objects.
+esp_err_t send_data(const Sample* samples, size_t count, const char* version) {
+    size_t size = count * SAMPLE_JSON_MAX + 3;
+    char*  data = malloc(size);
+    if (data == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    // Each sample gets SAMPLE_JSON_MAX bytes including its separator, one that needs more is dropped
+    time_t now = time(NULL);
+    size_t len = 0, sent = 0;
+    power_lock_cpu();
+    if (count > 1) data[len++] = '[';
+    for (size_t i = 0; i < count; i++) {
+        size_t separator = sent > 0;
+        int    n = format_sample(data + len + separator, SAMPLE_JSON_MAX - 1, &samples[i], now, count > 1);
+        if (n < 0) {
+            ESP_LOGE(TAG, "Sample %zu does not fit in %d bytes, dropped", i, SAMPLE_JSON_MAX);
+            continue;
+        }
+        if (separator) data[len++] = ',';
+        len += n;
+        sent++;
+    }
+    if (count > 1) data[len++] = ']';
+    data[len] = '\0';
+    power_unlock_cpu();
+
+    // None of them can ever be sent, the caller may drop them like delivered ones
+    if (sent == 0) {
+        free(data);
+        return ESP_OK;
+    }
+    ESP_LOGI(TAG, "Sending data: %s", data);
+
+    esp_http_client_handle_t client = s_stream_client ? s_stream_client : http_client_create();
+
     esp_http_client_set_header(client, "Version", version);
-    esp_http_client_set_post_field(client, data, strlen(data));
+    esp_http_client_set_post_field(client, data, len);
 
+    // Only a TLS handshake is CPU-bound enough to keep the clock up across the request
+    bool tls = esp_http_client_get_transport_type(client) == HTTP_TRANSPORT_OVER_SSL;
+    if (tls) power_lock_cpu();
     esp_err_t err = esp_http_client_perform(client);
+    if (tls) power_unlock_cpu();
     if (err == ESP_OK) {
+        int status = esp_http_client_get_status_code(client);
         ESP_LOGI(TAG, "HTTP POST Status = %d, content_length = %lli",
-                 esp_http_client_get_status_code(client),
+                 status,
                  esp_http_client_get_content_length(client));
+        if (status >= 300) {
+            err = ESP_FAIL;
+        }
     } else {
         ESP_LOGE(TAG, "HTTP POST request failed: %s", esp_err_to_name(err));
     }
-    esp_http_client_cleanup(client);
+    txpower_update(err == ESP_OK);
+    if (client != s_stream_client) {
+        esp_http_client_cleanup(client);
+    }
+    base_url_update(err == ESP_OK);
     free(data);
+    return err;
 }
 
 // Function to get an update
 void getUpdate(void) {
+    char url[SETTINGS_URL_MAX + sizeof(FIRMWARE_URL_PATH)];
+    snprintf(url, sizeof(url), "%s" FIRMWARE_URL_PATH, settings_base_url());
+
+    // No event handler: the body is the firmware image, not a settings response
     esp_http_client_config_t config = {
-        .url = FIRMWARE_URL,
-        .event_handler = http_client_event_handler,
+        .url = url,
         .keep_alive_enable = true,
     };
 
@@ -385,7 +785,9 @@ void getUpdate(void) {
         .http_config = &config,
     };
 
+    power_lock_cpu();
     esp_err_t ret = esp_https_ota(&ota_config);
+    power_unlock_cpu();
     if (ret == ESP_OK) {
         ESP_LOGI(TAG, "OTA OK, restarting...");
         esp_restart();
@@ -0,0 +1,129 @@
+// Cost of bme280_compensate_data() for the compensation variant this file is built with
+// Build once per variant: BME280_DOUBLE_ENABLE, BME280_32BIT_ENABLE or BME280_64BIT_ENABLE.
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "bme280.h"
+
+#ifdef ESP_PLATFORM
+#include "esp_cpu.h"
+#else
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#endif
+
+#define ITERATIONS 20000
+#define WARMUP     1000
+
+#if defined(BME280_DOUBLE_ENABLE)
+#define VARIANT "double"
+#elif defined(BME280_32BIT_ENABLE)
+#define VARIANT "32bit"
+#else
+#define VARIANT "64bit"
+#endif
+
+// Trim values and raw readings from the datasheet example (section 8.1), humidity from a real part
+static struct bme280_calib_data s_calib = {
+    .dig_t1 = 27504, .dig_t2 = 26435, .dig_t3 = -1000,
+    .dig_p1 = 36477, .dig_p2 = -10685, .dig_p3 = 3024, .dig_p4 = 2855, .dig_p5 = 140,
+    .dig_p6 = -7, .dig_p7 = 15500, .dig_p8 = -14600, .dig_p9 = 6000,
+    .dig_h1 = 75, .dig_h2 = 362, .dig_h3 = 0, .dig_h4 = 313, .dig_h5 = 50, .dig_h6 = 30,
+};
+
+static const struct bme280_uncomp_data s_raw[] = {
+    {.pressure = 415148, .temperature = 519888, .humidity = 30321},
+    {.pressure = 415990, .temperature = 512004, .humidity = 28764},
+    {.pressure = 414270, .temperature = 527551, .humidity = 33910},
+    {.pressure = 416832, .temperature = 503127, .humidity = 25012},
+};
+
+#define RAW_COUNT (sizeof(s_raw) / sizeof(s_raw[0]))
+
+// Cycle counter where there is one, the time in ns otherwise
+static uint64_t now_cycles(void) {
+#ifdef ESP_PLATFORM
+    return esp_cpu_get_cycle_count();
+#elif defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+static uint64_t now_ns(void) {
+#ifdef ESP_PLATFORM
+    return 0;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+// The first reading in engineering units, to check the variants against each other
+static void to_units(const struct bme280_data *data, double *temperature, double *pressure, double *humidity) {
+#if defined(BME280_DOUBLE_ENABLE)
+    *temperature = data->temperature;
+    *pressure = data->pressure;
+    *humidity = data->humidity;
+#elif defined(BME280_32BIT_ENABLE)
+    *temperature = data->temperature / 100.0;
+    *pressure = data->pressure;
+    *humidity = data->humidity / 1024.0;
+#else
+    *temperature = data->temperature / 100.0;
+    *pressure = data->pressure / 100.0;
+    *humidity = data->humidity / 1024.0;
+#endif
+}
+
+static int run_bench(void) {
+    struct bme280_data data;
+    volatile double    sink = 0;
+
+    for (int i = 0; i < WARMUP; i++) {
+        bme280_compensate_data(BME280_ALL, &s_raw[i % RAW_COUNT], &data, &s_calib);
+    }
+
+    uint64_t start_cycles = now_cycles();
+    uint64_t start_ns = now_ns();
+    for (int i = 0; i < ITERATIONS; i++) {
+        if (bme280_compensate_data(BME280_ALL, &s_raw[i % RAW_COUNT], &data, &s_calib) != BME280_OK) {
+            printf("%s: compensation failed\n", VARIANT);
+            return EXIT_FAILURE;
+        }
+        sink += data.temperature;
+    }
+    uint64_t cycles = now_cycles() - start_cycles;
+    uint64_t ns = now_ns() - start_ns;
+    (void)sink;
+
+    double temperature, pressure, humidity;
+    bme280_compensate_data(BME280_ALL, &s_raw[0], &data, &s_calib);
+    to_units(&data, &temperature, &pressure, &humidity);
+
+    printf("%-6s %8.1f cycles/call %8.1f ns/call   T %.2f degC  P %.2f Pa  H %.2f %%RH\n", VARIANT,
+           (double)cycles / ITERATIONS, (double)ns / ITERATIONS, temperature, pressure, humidity);
+
+    // The datasheet example is 25.08 degC and 100653 Pa
+    if (temperature < 25.0 || temperature > 25.2 || pressure < 100600 || pressure > 100700 || humidity <= 0 ||
+        humidity > 100) {
+        printf("%s: result out of range\n", VARIANT);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+#ifdef ESP_PLATFORM
+void app_main(void) {
+    run_bench();
+}
+#else
+int main(void) {
+    return run_bench();
+}
+#endif
@@ -0,0 +1,7 @@
+#ifndef __ESP_ATTR_H__
+#define __ESP_ATTR_H__
+
+// Host build: RTC memory is ordinary static storage
+#define RTC_DATA_ATTR
+
+#endif
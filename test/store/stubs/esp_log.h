@@ -0,0 +1,9 @@
+#ifndef __ESP_LOG_H__
+#define __ESP_LOG_H__
+
+// Host build: logging is dropped
+#define ESP_LOGE(tag, ...) ((void)(tag))
+#define ESP_LOGW(tag, ...) ((void)(tag))
+#define ESP_LOGI(tag, ...) ((void)(tag))
+
+#endif
@@ -0,0 +1,278 @@
+// Host round-trip tests of the sample store codec
+#include <inttypes.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "store.c"
+
+static int s_failures = 0;
+
+#define CHECK(cond)                                                   \
+    do {                                                              \
+        if (!(cond)) {                                                \
+            printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            s_failures++;                                             \
+        }                                                             \
+    } while (0)
+
+#define ALL_GROUPS (SAMPLE_MOISTURE | SAMPLE_CLIMATE | SAMPLE_LIGHT | SAMPLE_DLI | SAMPLE_ALERTS)
+
+// A sample with every field set from a seed, values stay on the stored scales
+static Sample make_sample(time_t timestamp, uint32_t valid, int seed) {
+    Sample sample = {0};
+
+    sample.timestamp = timestamp;
+    sample.valid = valid;
+    sample.battery_mv = 3700 - seed;
+    sample.moisture_mask = (1 << MOISTURE_PROBES) - 1;
+    for (int i = 0; i < MOISTURE_PROBES; i++) {
+        sample.moisture[i] = (4000 + seed * 7 - i * 300) / (double)MOISTURE_SCALE;
+    }
+    sample.climate_mask = (1 << CLIMATE_SENSORS) - 1;
+    for (int i = 0; i < CLIMATE_SENSORS; i++) {
+        sample.temperature[i] = -1500 + seed * 13 + i;
+        sample.humidity[i] = 51200 + seed * 31 - i;
+        sample.pressure[i] = 10132500 - seed * 101 + i;
+        sample.vpd[i] = 900 + seed;
+        sample.dew_point[i] = -300 + seed * 3;
+        sample.abs_humidity[i] = 9000 + seed * 5;
+    }
+    sample.white = (250000 + seed * 1234) / (double)LUX_SCALE;
+    sample.visible = (120000 + seed * 567) / (double)LUX_SCALE;
+    sample.dli = (8000 + seed * 11) / (double)DLI_SCALE;
+    sample.dli_previous = seed % 2 ? -1 : 12.345;
+    sample.alerts = seed & 0x1FF;
+    sample.alert_changes = (seed * 3) & 0x1FF;
+    return sample;
+}
+
+// Compare only what the valid bits and instance masks say was measured
+static bool same_sample(const Sample *a, const Sample *b) {
+    if (a->timestamp != b->timestamp || a->valid != b->valid || a->battery_mv != b->battery_mv) {
+        return false;
+    }
+    if (a->valid & SAMPLE_MOISTURE) {
+        if (a->moisture_mask != b->moisture_mask) {
+            return false;
+        }
+        for (int i = 0; i < MOISTURE_PROBES; i++) {
+            if ((a->moisture_mask & (1 << i)) && fabs(a->moisture[i] - b->moisture[i]) > 0.5 / MOISTURE_SCALE) {
+                return false;
+            }
+        }
+    }
+    if (a->valid & SAMPLE_CLIMATE) {
+        if (a->climate_mask != b->climate_mask) {
+            return false;
+        }
+        for (int i = 0; i < CLIMATE_SENSORS; i++) {
+            if (!(a->climate_mask & (1 << i))) {
+                continue;
+            }
+            if (a->temperature[i] != b->temperature[i] || a->humidity[i] != b->humidity[i] ||
+                a->pressure[i] != b->pressure[i] || a->vpd[i] != b->vpd[i] ||
+                a->dew_point[i] != b->dew_point[i] || a->abs_humidity[i] != b->abs_humidity[i]) {
+                return false;
+            }
+        }
+    }
+    if ((a->valid & SAMPLE_LIGHT) &&
+        (fabs(a->white - b->white) > 0.5 / LUX_SCALE || fabs(a->visible - b->visible) > 0.5 / LUX_SCALE)) {
+        return false;
+    }
+    if ((a->valid & SAMPLE_DLI) &&
+        (fabs(a->dli - b->dli) > 0.5 / DLI_SCALE || fabs(a->dli_previous - b->dli_previous) > 0.5 / DLI_SCALE)) {
+        return false;
+    }
+    if ((a->valid & SAMPLE_ALERTS) && (a->alerts != b->alerts || a->alert_changes != b->alert_changes)) {
+        return false;
+    }
+    return true;
+}
+
+// Decode everything in the store, returns the number of samples
+static size_t read_all(Sample *out, size_t max) {
+    StoreIterator it;
+    size_t        count = 0;
+
+    store_iterate_begin(&it);
+    while (count < max && store_iterate(&it, &out[count])) {
+        count++;
+    }
+    return count;
+}
+
+static void test_zigzag_varint(void) {
+    static const int64_t values[] = {0, 1, -1, 63, -64, 64, INT32_MAX, INT32_MIN, INT64_MAX, INT64_MIN};
+    uint8_t              buffer[10];
+    uint64_t             decoded;
+
+    CHECK(zigzag(0) == 0);
+    CHECK(zigzag(-1) == 1);
+    CHECK(zigzag(1) == 2);
+    CHECK(zigzag(INT64_MAX) == UINT64_MAX - 1);
+    CHECK(zigzag(INT64_MIN) == UINT64_MAX);
+
+    for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); i++) {
+        CHECK(unzigzag(zigzag(values[i])) == values[i]);
+
+        size_t len = put_varint(buffer, zigzag(values[i]));
+        CHECK(get_varint(buffer, len, &decoded) == len);
+        CHECK(unzigzag(decoded) == values[i]);
+    }
+
+    // Length limits: one byte below 0x80, ten bytes for the full 64 bits
+    CHECK(put_varint(buffer, 0x7F) == 1);
+    CHECK(put_varint(buffer, 0x80) == 2);
+    CHECK(put_varint(buffer, UINT64_MAX) == 10);
+    CHECK(get_varint(buffer, 10, &decoded) == 10 && decoded == UINT64_MAX);
+
+    // Truncated input and runaway continuation bits are rejected
+    CHECK(get_varint(buffer, 9, &decoded) == 0);
+    memset(buffer, 0x80, sizeof(buffer));
+    CHECK(get_varint(buffer, sizeof(buffer), &decoded) == 0);
+}
+
+static void test_round_trip(void) {
+    Sample written[20], read[20];
+
+    store_clear();
+    for (int i = 0; i < 20; i++) {
+        // Irregular intervals exercise the delta-of-delta time
+        written[i] = make_sample(1700000000 + i * 3600 + (i % 3) * 17, ALL_GROUPS | (i % 4 ? 0 : SAMPLE_URGENT), i);
+        store_append(&written[i]);
+    }
+
+    CHECK(store_count() == 20);
+    CHECK(read_all(read, 20) == 20);
+    for (int i = 0; i < 20; i++) {
+        CHECK(same_sample(&written[i], &read[i]));
+    }
+}
+
+static void test_skipped_groups(void) {
+    static const uint32_t masks[] = {
+        ALL_GROUPS, 0, SAMPLE_CLIMATE, SAMPLE_MOISTURE | SAMPLE_LIGHT, SAMPLE_DLI, SAMPLE_ALERTS, ALL_GROUPS,
+    };
+    const int count = sizeof(masks) / sizeof(masks[0]);
+    Sample    written[sizeof(masks) / sizeof(masks[0])], read[sizeof(masks) / sizeof(masks[0])];
+
+    store_clear();
+    for (int i = 0; i < count; i++) {
+        written[i] = make_sample(1700000000 + i * 600, masks[i], i * 5);
+
+        // Missing instances are not written at all
+        if (i == 2) {
+            written[i].climate_mask = 0x2;
+        }
+        if (i == 3) {
+            written[i].moisture_mask = 0x5;
+        }
+        store_append(&written[i]);
+    }
+
+    CHECK(read_all(read, count) == (size_t)count);
+    for (int i = 0; i < count; i++) {
+        CHECK(same_sample(&written[i], &read[i]));
+    }
+
+    // A skipped group costs nothing: battery only is time, mask and one field
+    StoreCodec codec = {0};
+    uint8_t    record[MAX_RECORD];
+    Sample     bare = make_sample(0, 0, 0);
+    CHECK(encode(&codec, &bare, record) == 1 + 1 + 2);
+}
+
+static void test_rollover(void) {
+    enum { APPENDED = 400 };
+    static Sample written[APPENDED], read[APPENDED];
+
+    store_clear();
+    for (int i = 0; i < APPENDED; i++) {
+        written[i] = make_sample(1700000000 + i * 3600, ALL_GROUPS, i * 97 % 1000);
+        store_append(&written[i]);
+        CHECK(s_used <= STORE_BLOCKS);
+    }
+
+    // The oldest blocks were dropped, what is left is the newest run in order
+    size_t count = store_count();
+    CHECK(s_used == STORE_BLOCKS);
+    CHECK(count > 0 && count < APPENDED);
+    CHECK(read_all(read, APPENDED) == count);
+    for (size_t i = 0; i < count; i++) {
+        CHECK(same_sample(&written[APPENDED - count + i], &read[i]));
+    }
+
+    // Each remaining block starts from a keyframe, so it decodes without its predecessor
+    StoreIterator it;
+    Sample        sample;
+    store_iterate_begin(&it);
+    it.block = STORE_BLOCKS - 1;
+    size_t tail = 0;
+    while (store_iterate(&it, &sample)) {
+        tail++;
+    }
+    CHECK(tail == s_blocks[(s_first + STORE_BLOCKS - 1) % STORE_BLOCKS].count);
+    CHECK(same_sample(&written[APPENDED - 1], &sample));
+
+    store_clear();
+    CHECK(store_count() == 0);
+    CHECK(read_all(read, APPENDED) == 0);
+}
+
+static void test_drop(void) {
+    enum { APPENDED = 120 };
+    static Sample written[APPENDED], read[APPENDED];
+
+    store_clear();
+    for (int i = 0; i < APPENDED; i++) {
+        written[i] = make_sample(1700000000 + i * 3600, ALL_GROUPS, i);
+        store_append(&written[i]);
+    }
+    size_t total = store_count();
+    size_t first = APPENDED - total;
+    CHECK(s_used > 1);
+
+    // Drop inside the oldest block, then across a block boundary, in slices like an upload
+    size_t dropped = 0;
+    size_t slices[] = {1, 5, s_blocks[s_first].count, 16};
+    for (size_t s = 0; s < sizeof(slices) / sizeof(slices[0]); s++) {
+        store_drop(slices[s]);
+        dropped += slices[s];
+        CHECK(store_count() == total - dropped);
+        CHECK(read_all(read, APPENDED) == total - dropped);
+        CHECK(same_sample(&written[first + dropped], &read[0]));
+        CHECK(same_sample(&written[APPENDED - 1], &read[total - dropped - 1]));
+    }
+
+    // Appending after a partial drop keeps both the skipped start and the new sample right
+    Sample extra = make_sample(1700000000 + APPENDED * 3600, ALL_GROUPS, APPENDED);
+    store_append(&extra);
+    CHECK(store_count() == total - dropped + 1);
+    CHECK(read_all(read, APPENDED) == total - dropped + 1);
+    CHECK(same_sample(&written[first + dropped], &read[0]));
+    CHECK(same_sample(&extra, &read[total - dropped]));
+
+    // Dropping more than is stored empties the store
+    store_drop(APPENDED * 2);
+    CHECK(store_count() == 0);
+    CHECK(s_used == 0 && s_skip == 0);
+    store_append(&extra);
+    CHECK(read_all(read, APPENDED) == 1 && same_sample(&extra, &read[0]));
+}
+
+int main(void) {
+    test_zigzag_varint();
+    test_round_trip();
+    test_skipped_groups();
+    test_rollover();
+    test_drop();
+
+    if (s_failures) {
+        printf("%d checks failed\n", s_failures);
+        return EXIT_FAILURE;
+    }
+    printf("All store tests passed\n");
+    return EXIT_SUCCESS;
+}